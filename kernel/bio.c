@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -10,6 +10,16 @@
 // * After changing buffer data, call bwrite to write it to disk.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
+// * To start reading a block that will be wanted soon,
+//     call bread_async; bread then finds it cached.
+// * To write many blocks at once, call bwrite_async on
+//     each and then bwait on each.
+// * To overwrite a whole block, call bclaim, which doesn't
+//     read it, fill in b->data, and set b->valid.
+// * bshadow allocates a buffer outside the cache, whose
+//     contents its owner writes wherever it likes.
+// * bread_direct reads blocks into memory outside the cache,
+//     for the page cache.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
 
@@ -23,69 +33,285 @@
 #include "fs.h"
 #include "buf.h"
 
+#define NBUCKET 251  // prime, so that block numbers spread out
+#define NSCAN   64   // buffers bget() examines to pick one to recycle
+#define NDIRECTIO 4  // disk reads bread_direct() has outstanding at once
+
+// Buffers are hashed by (dev, blockno) into buckets, each
+// with its own lock, so that lookups of different blocks
+// don't contend. A buffer's refcnt, lastuse and bucket
+// membership are protected by the lock of its bucket.
+//
+// Buffers and their data are allocated from slab caches on
+// demand, up to a limit set at boot from the amount of free
+// memory. When memory runs low, kalloc() calls bshrink() to
+// free the least recently used unreferenced buffers, down to
+// NBUF of them.
+//
+// Allocating, recycling and freeing buffers is serialized by
+// bcache.lock. Lock order: bcache.lock, then bucket locks in
+// increasing order.
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct kmem_cache *bufcache;   // struct buf
+  struct kmem_cache *datacache;  // BSIZE data blocks
+  int n;        // buffers allocated
+  int max;      // limit on n
+  int hand;     // bucket where the next recycling scan starts
+  int nwait;    // processes in bget() that may wait for a buffer
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  struct {
+    struct spinlock lock;
+    struct buf head;  // circular list through prev/next
+  } bucket[NBUCKET];
 } bcache;
 
+static uint64 bshrink(uint64);
+static void bput(struct buf*);
+
+static int
+bhash(uint dev, uint blockno)
+{
+  return (dev * 31 + blockno) % NBUCKET;
+}
+
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+static void
+blink(struct buf *head, struct buf *b)
+{
+  b->next = head->next;
+  b->prev = head;
+  head->next->prev = b;
+  head->next = b;
+}
+
+// Allocate a new, unreferenced buffer.
+// Caller must hold bcache.lock.
+static struct buf*
+bnew(void)
+{
+  struct buf *b;
+
+  if(bcache.n >= bcache.max)
+    return 0;
+  if((b = kmem_cache_alloc(bcache.bufcache)) == 0)
+    return 0;
+  if((b->data = kmem_cache_alloc(bcache.datacache)) == 0){
+    kmem_cache_free(bcache.bufcache, b);
+    return 0;
+  }
+  initsleeplock(&b->lock, "buffer");
+  b->valid = 0;
+  b->disk = 0;
+  b->refcnt = 0;
+  b->lastuse = 0;
+  bcache.n++;
+  return b;
+}
+
 void
 binit(void)
 {
   struct buf *b;
 
   initlock(&bcache.lock, "bcache");
+  for(int i = 0; i < NBUCKET; i++){
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+    bcache.bucket[i].head.prev = &bcache.bucket[i].head;
+    bcache.bucket[i].head.next = &bcache.bucket[i].head;
+  }
+  bcache.bufcache = kmem_cache_create("buf", sizeof(struct buf));
+  bcache.datacache = kmem_cache_create("bufdata", BSIZE);
+
+  // let the cache grow to an eighth of free memory.
+  bcache.max = kfreepages() / 8 * (PGSIZE / BSIZE);
+  if(bcache.max < NBUF)
+    bcache.max = NBUF;
+
+  // Start with NBUF buffers in bucket 0;
+  // bget() moves them as it recycles them.
+  acquire(&bcache.lock);
+  for(int i = 0; i < NBUF; i++){
+    if((b = bnew()) == 0)
+      panic("binit");
+    b->dev = 0;
+    b->blockno = 0;
+    blink(&bcache.bucket[0].head, b);
+  }
+  release(&bcache.lock);
+
+  kshrinker(bshrink);
+}
+
+// Look for block on device dev in bucket i, whose lock
+// the caller must hold. If found, take a reference.
+static struct buf*
+bfind(int i, uint dev, uint blockno)
+{
+  struct buf *b;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  for(b = bcache.bucket[i].head.next; b != &bcache.bucket[i].head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      return b;
+    }
   }
+  return 0;
+}
+
+// Find an unreferenced buffer to recycle: the least recently
+// used among the first NSCAN or so buffers from the clock hand
+// on. Returns it with the lock of its bucket held, and its bucket
+// in *bi, or returns 0 if every buffer is in use.
+// Caller must hold bcache.lock.
+static struct buf*
+bvictim(int *bi)
+{
+  struct buf *b, *victim = 0;
+  int vi = -1, seen = 0;
+
+  for(int k = 0; k < NBUCKET && (victim == 0 || seen < NSCAN); k++){
+    int j = (bcache.hand + k) % NBUCKET;
+    int found = 0;
+    acquire(&bcache.bucket[j].lock);
+    for(b = bcache.bucket[j].head.next; b != &bcache.bucket[j].head; b = b->next){
+      seen++;
+      if(b->refcnt == 0 && (victim == 0 || b->lastuse < victim->lastuse)){
+        victim = b;
+        found = 1;
+      }
+    }
+    if(found){
+      if(vi >= 0)
+        release(&bcache.bucket[vi].lock);
+      vi = j;
+    } else {
+      release(&bcache.bucket[j].lock);
+    }
+  }
+  if(victim)
+    bcache.hand = (vi + 1) % NBUCKET;
+  *bi = vi;
+  return victim;
 }
 
 // Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
+// If not found, allocate a buffer, or recycle one, waiting
+// if all are in use.
 // In either case, return locked buffer.
 static struct buf*
 bget(uint dev, uint blockno)
 {
   struct buf *b;
+  int i, vi;
 
-  acquire(&bcache.lock);
+  i = bhash(dev, blockno);
+  acquire(&bcache.bucket[i].lock);
+  b = bfind(i, dev, blockno);
+  release(&bcache.bucket[i].lock);
+  if(b){
+    acquiresleep(&b->lock);
+    return b;
+  }
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
+  acquire(&bcache.lock);
+  for(;;){
+    // Look again, since another process may have cached
+    // the block while no lock was held.
+    acquire(&bcache.bucket[i].lock);
+    b = bfind(i, dev, blockno);
+    release(&bcache.bucket[i].lock);
+    if(b){
       release(&bcache.lock);
       acquiresleep(&b->lock);
       return b;
     }
+
+    if((b = bnew()) != 0){
+      vi = -1;
+      break;
+    }
+
+    // Recycle. Count this process as a waiter before looking, so
+    // that a brelse() of a buffer the scan has already passed
+    // knows to wake it up.
+    bcache.nwait++;
+    b = bvictim(&vi);
+    if(b){
+      bcache.nwait--;
+      break;
+    }
+    sleep(&bcache, &bcache.lock);
+    bcache.nwait--;
   }
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  b->pins = 0;
+  if(vi != i){
+    if(vi >= 0){
+      bunlink(b);
+      release(&bcache.bucket[vi].lock);
     }
+    acquire(&bcache.bucket[i].lock);
+    blink(&bcache.bucket[i].head, b);
+  }
+  release(&bcache.bucket[i].lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Shrinker, called by kalloc() when memory is low: free
+// about n pages' worth of unreferenced buffers, keeping at
+// least NBUF. Returns 0, since the buffers go back to the
+// slab allocator, whose shrinker frees the pages.
+static uint64
+bshrink(uint64 n)
+{
+  struct buf *b;
+  uint64 nbuf = 0;
+  int vi;
+
+  push_off();
+  int busy = holding(&bcache.lock);  // e.g. bnew() is allocating
+  pop_off();
+  if(busy)
+    return 0;
+
+  acquire(&bcache.lock);
+  while(nbuf < n * (PGSIZE / BSIZE) && bcache.n > NBUF){
+    if((b = bvictim(&vi)) == 0)
+      break;
+    bunlink(b);
+    release(&bcache.bucket[vi].lock);
+    kmem_cache_free(bcache.datacache, b->data);
+    kmem_cache_free(bcache.bufcache, b);
+    bcache.n--;
+    nbuf++;
+  }
+  release(&bcache.lock);
+  return 0;
+}
+
+// A buffer's refcnt has fallen to 0; wake up any
+// bget() that is waiting for a buffer to recycle.
+static void
+bunused(void)
+{
+  if(bcache.nwait > 0){
+    acquire(&bcache.lock);
+    wakeup(&bcache);
+    release(&bcache.lock);
   }
-  panic("bget: no buffers");
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -102,6 +328,15 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Return a locked buf for a block that the caller will
+// overwrite entirely, without reading the block from disk.
+// The caller sets b->valid once it has filled in b->data.
+struct buf*
+bclaim(uint dev, uint blockno)
+{
+  return bget(dev, blockno);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,8 +346,135 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Start reading a block into the cache without waiting for
+// it, in the hope that bread() will ask for it soon. Does
+// nothing if the block is already cached or being read, or
+// if the disk queue is full. The read is queued; bkick()
+// or the next bread() or bwait() sends it to the disk.
+void
+bread_async(uint dev, uint blockno)
+{
+  struct buf *b;
+  int i;
+
+  i = bhash(dev, blockno);
+  acquire(&bcache.bucket[i].lock);
+  b = bfind(i, dev, blockno);
+  if(b)
+    b->refcnt--;  // just looking
+  release(&bcache.bucket[i].lock);
+  if(b)
+    return;
+
+  b = bget(dev, blockno);
+  if(b->valid || virtio_disk_submit(b, 0, 1) < 0)
+    brelse(b);
+  // otherwise bdone() releases b when the read finishes.
+}
+
+// Queue a write of b's contents to disk. Must be locked.
+// Call bwait(b) before releasing b.
+void
+bwrite_async(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_async");
+  virtio_disk_submit(b, 1, 0);
+}
+
+// Wait for a bwrite_async(b) to finish, sending any
+// queued requests to the disk first.
+void
+bwait(struct buf *b)
+{
+  virtio_disk_wait(b);
+}
+
+// Send queued requests to the disk.
+void
+bkick(void)
+{
+  virtio_disk_kick();
+}
+
+// Called by the disk interrupt handler when a read started
+// by bread_async() has finished.
+void
+bdone(struct buf *b)
+{
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bput(b);
+}
+
+// Read blocks blockno[0..n-1] of dev into dst[0..n-1], BSIZE bytes
+// each, for the page cache, which keeps file data outside the
+// buffer cache. A block that is cached is copied from its buffer,
+// which may be newer than the disk (e.g. logged but not yet
+// checkpointed); the rest are read straight from the disk into dst,
+// without taking a buffer, in batches so that runs of adjacent
+// blocks become single transfers.
+void
+bread_direct(uint dev, uint *blockno, uchar **dst, int n)
+{
+  struct buf io[NDIRECTIO], *b;
+  int i, k, nio;
+
+  for(i = 0; i < n; i += k){
+    nio = 0;
+    for(k = 0; i + k < n && nio < NDIRECTIO; k++){
+      int h = bhash(dev, blockno[i+k]);
+      acquire(&bcache.bucket[h].lock);
+      b = bfind(h, dev, blockno[i+k]);
+      release(&bcache.bucket[h].lock);
+      if(b){
+        acquiresleep(&b->lock);
+        if(b->valid){
+          memmove(dst[i+k], b->data, BSIZE);
+          brelse(b);
+          continue;
+        }
+        brelse(b);
+      }
+      io[nio].dev = dev;
+      io[nio].blockno = blockno[i+k];
+      io[nio].data = dst[i+k];
+      virtio_disk_submit(&io[nio], 0, 0);
+      nio++;
+    }
+    for(int j = 0; j < nio; j++)
+      bwait(&io[j]);
+  }
+}
+
+// Allocate a buffer that is not part of the cache, for a caller
+// that keeps its own copies of blocks to write to disk (the log).
+// The caller sets b->blockno before each write; no one else can
+// find the buffer, so it may point it anywhere. Returns it locked
+// by the caller, or 0 if there is no memory.
+struct buf*
+bshadow(uint dev)
+{
+  struct buf *b;
+
+  if((b = kmem_cache_alloc(bcache.bufcache)) == 0)
+    return 0;
+  if((b->data = kmem_cache_alloc(bcache.datacache)) == 0){
+    kmem_cache_free(bcache.bufcache, b);
+    return 0;
+  }
+  initsleeplock(&b->lock, "shadow");
+  b->dev = dev;
+  b->blockno = 0;
+  b->valid = 1;
+  b->disk = 0;
+  b->refcnt = 1;
+  b->pins = 0;
+  acquiresleep(&b->lock);
+  return b;
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +482,51 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
+  bput(b);
+}
 
-  acquire(&bcache.lock);
+// Drop a reference to an unlocked buffer.
+// Stamp it with the time, for LRU recycling in bget().
+static void
+bput(struct buf *b)
+{
+  int i, unused;
+
+  i = bhash(b->dev, b->blockno);
+  acquire(&bcache.bucket[i].lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
+  unused = b->refcnt == 0;
+  if (unused) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = ticks;
   }
-  
-  release(&bcache.lock);
+  release(&bcache.bucket[i].lock);
+
+  if(unused)
+    bunused();
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int i = bhash(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[i].lock);
   b->refcnt++;
-  release(&bcache.lock);
+  b->pins++;
+  release(&bcache.bucket[i].lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt--;
-  release(&bcache.lock);
-}
+  int i = bhash(b->dev, b->blockno);
+  int unused;
 
+  acquire(&bcache.bucket[i].lock);
+  b->refcnt--;
+  b->pins--;
+  unused = b->refcnt == 0;
+  release(&bcache.bucket[i].lock);
 
+  if(unused)
+    bunused();
+}
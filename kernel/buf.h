@@ -5,8 +5,12 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint pins;        // references held by the log (bpin())
+  uint lastuse;     // ticks when refcnt last fell to 0, for LRU
+  struct buf *prev; // hash bucket list
   struct buf *next;
-  uchar data[BSIZE];
+  struct buf *qnext; // next buf in the same disk request
+  int queue;         // virtio queue of the request
+  uchar *data;      // BSIZE bytes
 };
 
@@ -0,0 +1,242 @@
+// Directory name lookup cache.
+//
+// The dcache remembers the results of dirlookup(): for a name
+// in a directory, the inode number it refers to and the offset
+// of its directory entry, or that the directory has no such
+// name (a negative entry). So a path that has been looked up
+// before resolves without reading directory contents.
+//
+// The caller must hold the directory's inode lock both to look
+// up entries and to change them, so that the dcache and the
+// directory change together: dirlink() enters the new name,
+// unlink() replaces it with a negative entry, and iput()
+// purges the entries of a directory that is being freed.
+//
+// Entries are allocated from a slab cache, hashed by directory
+// and name, hashed again by directory alone so that a purge need
+// visit only that directory's chain, and kept on an LRU list.
+// dcache_enter() recycles the least recently used entry once
+// there are dcache.max of them, and dcache_shrink() frees them
+// when memory runs low.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+#define NDHASH 251  // prime, so that names spread out
+
+struct dentry {
+  uint dev;
+  uint dir;            // inode number of the directory
+  char name[DIRSIZ];
+  uint inum;           // 0 if the directory has no such name
+  uint off;            // offset of the directory entry
+  struct dentry *hnext;  // hash chain
+  struct dentry *dnext;  // chain of dcache.dirs
+  struct dentry **dpprev;  // what points to this entry in it
+  struct dentry *lnext;  // LRU list
+  struct dentry *lprev;
+};
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache *cache;
+  int n;                        // entries allocated
+  int max;                      // limit on n
+  struct dentry *hash[NDHASH];
+  struct dentry *dirs[NDHASH];  // hashed by directory only
+  struct dentry lru;            // most recently used first
+} dcache;
+
+static uint64 dcache_shrink(uint64);
+
+void
+dcacheinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+  dcache.cache = kmem_cache_create("dentry", sizeof(struct dentry));
+  dcache.lru.lnext = &dcache.lru;
+  dcache.lru.lprev = &dcache.lru;
+
+  // let the cache grow to a sixty-fourth of free memory.
+  dcache.max = kfreepages() / 64 * (PGSIZE / sizeof(struct dentry));
+
+  kshrinker(dcache_shrink);
+}
+
+static int
+dhash(uint dev, uint dir, char *name)
+{
+  uint h = dev * 31 + dir;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDHASH;
+}
+
+static int
+dhashdir(uint dev, uint dir)
+{
+  return (dev * 31 + dir) % NDHASH;
+}
+
+static void
+lru_remove(struct dentry *d)
+{
+  d->lprev->lnext = d->lnext;
+  d->lnext->lprev = d->lprev;
+}
+
+static void
+lru_push(struct dentry *d)
+{
+  d->lnext = dcache.lru.lnext;
+  d->lprev = &dcache.lru;
+  dcache.lru.lnext->lprev = d;
+  dcache.lru.lnext = d;
+}
+
+// Remove d from its hash chains and the LRU list.
+// Caller must hold dcache.lock.
+static void
+dunlink(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = &dcache.hash[dhash(d->dev, d->dir, d->name)]; *pp != d; pp = &(*pp)->hnext)
+    ;
+  *pp = d->hnext;
+  *d->dpprev = d->dnext;
+  if(d->dnext)
+    d->dnext->dpprev = d->dpprev;
+  lru_remove(d);
+}
+
+// Find the entry for name in directory dp, moving it to the
+// front of the LRU list. Caller must hold dcache.lock.
+static struct dentry*
+dfind(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.hash[dhash(dp->dev, dp->inum, name)]; d; d = d->hnext){
+    if(d->dev == dp->dev && d->dir == dp->inum &&
+       strncmp(d->name, name, DIRSIZ) == 0){
+      lru_remove(d);
+      lru_push(d);
+      return d;
+    }
+  }
+  return 0;
+}
+
+// Look up name in directory dp. If the dcache knows the answer,
+// set *inum to the inode number (0 if the name is not there) and
+// *poff to the offset of the entry, and return 1; otherwise return 0.
+// Caller must hold dp->lock.
+int
+dcache_lookup(struct inode *dp, char *name, uint *inum, uint *poff)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  d = dfind(dp, name);
+  if(d){
+    *inum = d->inum;
+    *poff = d->off;
+  }
+  release(&dcache.lock);
+  return d != 0;
+}
+
+// Record that name in directory dp refers to inode inum,
+// whose entry is at offset off, or that there is no such
+// name if inum is 0. Caller must hold dp->lock.
+void
+dcache_enter(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+  int h;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp, name)) == 0){
+    if(dcache.n < dcache.max && (d = kmem_cache_alloc(dcache.cache)) != 0){
+      dcache.n++;
+    } else if((d = dcache.lru.lprev) != &dcache.lru){
+      dunlink(d);
+    } else {
+      release(&dcache.lock);
+      return;
+    }
+    d->dev = dp->dev;
+    d->dir = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    h = dhash(d->dev, d->dir, d->name);
+    d->hnext = dcache.hash[h];
+    dcache.hash[h] = d;
+    h = dhashdir(d->dev, d->dir);
+    d->dnext = dcache.dirs[h];
+    d->dpprev = &dcache.dirs[h];
+    if(d->dnext)
+      d->dnext->dpprev = &d->dnext;
+    dcache.dirs[h] = d;
+    lru_push(d);
+  }
+  d->inum = inum;
+  d->off = off;
+  release(&dcache.lock);
+}
+
+// Forget every entry of directory dp, which is being freed,
+// so that none can be mistaken for an entry of a new directory
+// with the same inode number. Caller must hold dp->lock.
+void
+dcache_purge(struct inode *dp)
+{
+  struct dentry *d, *next;
+
+  acquire(&dcache.lock);
+  for(d = dcache.dirs[dhashdir(dp->dev, dp->inum)]; d; d = next){
+    next = d->dnext;
+    if(d->dev == dp->dev && d->dir == dp->inum){
+      dunlink(d);
+      kmem_cache_free(dcache.cache, d);
+      dcache.n--;
+    }
+  }
+  release(&dcache.lock);
+}
+
+// Shrinker, called by kalloc() when memory is low: free about
+// n pages' worth of the least recently used entries. Returns 0,
+// since the entries go back to the slab allocator, whose
+// shrinker frees the pages.
+static uint64
+dcache_shrink(uint64 n)
+{
+  struct dentry *d;
+  uint64 nfree = 0;
+
+  push_off();
+  int busy = holding(&dcache.lock);  // e.g. dcache_enter() is allocating
+  pop_off();
+  if(busy)
+    return 0;
+
+  acquire(&dcache.lock);
+  while(nfree < n * (PGSIZE / sizeof(struct dentry))){
+    if((d = dcache.lru.lprev) == &dcache.lru)
+      break;
+    dunlink(d);
+    kmem_cache_free(dcache.cache, d);
+    dcache.n--;
+    nfree++;
+  }
+  release(&dcache.lock);
+  return 0;
+}
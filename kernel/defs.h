@@ -2,6 +2,9 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct iovec;
+struct kmem_cache;
+struct memstat;
 struct pipe;
 struct proc;
 struct spinlock;
@@ -12,6 +15,14 @@ struct superblock;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bclaim(uint, uint);
+void            bread_async(uint, uint);
+void            bdone(struct buf*);
+void            bwrite_async(struct buf*);
+void            bwait(struct buf*);
+void            bkick(void);
+struct buf*     bshadow(uint);
+void            bread_direct(uint, uint*, uchar**, int);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
@@ -22,6 +33,12 @@ void            consoleinit(void);
 void            consoleintr(int);
 void            consputc(int);
 
+// dcache.c
+void            dcacheinit(void);
+int             dcache_lookup(struct inode*, char*, uint*, uint*);
+void            dcache_enter(struct inode*, char*, uint, uint);
+void            dcache_purge(struct inode*);
+
 // exec.c
 int             exec(char*, char**);
 
@@ -31,12 +48,16 @@ void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
+int             filereadv(struct file*, struct iovec*, int, int);
 int             filestat(struct file*, uint64 addr);
+int             filesync(struct file*);
 int             filewrite(struct file*, uint64, int n);
+int             filewritev(struct file*, struct iovec*, int, int);
 
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
+int             dirhashed(struct inode*);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
@@ -50,10 +71,22 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+void            readpages(struct inode*, uint, char**, int);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
 
+// pcache.c
+void            pcacheinit(void);
+int             pcache_read(struct inode*, int, uint64, uint, uint);
+char*           pcache_get(struct inode*, uint);
+void            pcache_write(struct inode*, uint, uchar*, uint);
+void            pcache_trunc(struct inode*, uint);
+
+// sysfile.c
+void            munmapall(struct proc*);
+int             mmapcopy(struct proc*, struct proc*);
+
 // ramdisk.c
 void            ramdiskinit(void);
 void            ramdiskintr(void);
@@ -61,20 +94,37 @@ void            ramdiskrw(struct buf*);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_order(int);
+void            kdup(void *);
 void            kfree(void *);
+int             krefcnt(void *);
 void            kinit(void);
+uint64          kfreepages(void);
+void            kmemdump(void);
+void            kmemstat(struct memstat*);
+void            kshrinker(uint64 (*)(uint64));
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
+void            begin_opn(int);
 void            end_op(void);
+void            end_opn(int);
+void            log_sync(void);
+uint            log_opseq(void);
+int             log_committed(uint);
+#ifdef FSCRASH
+int             log_crash(void);
+#endif
+void            logtick(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             piperead(struct pipe*, struct iovec*, int);
+int             pipewrite(struct pipe*, struct iovec*, int);
 
 // printf.c
 void            printf(char*, ...);
@@ -106,6 +156,9 @@ void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+void            kthread(char*, void (*)(void));
+void            oomkill(struct proc*);
+int             procmemstat(int, struct memstat*);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -118,6 +171,12 @@ void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -165,6 +224,7 @@ void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopyrange(pagetable_t, pagetable_t, uint64, uint64, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -173,6 +233,11 @@ uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
+int             vmfault(pagetable_t, uint64, int);
+struct vma*     vmafind(struct proc*, uint64);
+uint64          vmabase(struct proc*);
+void            vmaprefault(uint64, uint64, int);
+void            uvmstat(pagetable_t, uint64*, uint64*);
 
 // plic.c
 void            plicinit(void);
@@ -183,6 +248,9 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+int             virtio_disk_submit(struct buf *, int, int);
+void            virtio_disk_kick(void);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -120,10 +120,14 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
     
-  // Commit to the user image.
+  // Commit to the user image, first removing the old
+  // image's mmap() regions.
+  munmapall(p);
+  acquire(&p->lock);  // procmemstat() may be walking the old page table
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
+  release(&p->lock);
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
@@ -12,17 +12,19 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "uio.h"
 
 struct devsw devsw[NDEV];
 struct {
-  struct spinlock lock;
-  struct file file[NFILE];
+  struct spinlock lock; // protects f->ref of all files
+  struct kmem_cache *cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = kmem_cache_create("file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -31,16 +33,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -72,6 +69,7 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -101,32 +99,81 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Wait until file f's contents are on disk.
+int
+filesync(struct file *f)
+{
+  if(f->type == FD_INODE){
+    log_sync();
+    return 0;
+  }
+  return -1;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
 fileread(struct file *f, uint64 addr, int n)
 {
-  int r = 0;
+  struct iovec iov = { (void*)addr, n };
+
+  return filereadv(f, &iov, 1, -1);
+}
+
+// Read from file f into the n buffers described by iov,
+// filling each before moving on to the next. The buffers are
+// at user virtual addresses. If off is -1, read at f->off and
+// advance it; otherwise read at offset off and leave f->off
+// alone, as pread() does. An inode is locked once for all
+// the buffers.
+int
+filereadv(struct file *f, struct iovec *iov, int n, int off)
+{
+  int r = 0, k, tot = 0;
+  uint o;
 
   if(f->readable == 0)
     return -1;
+  if(off >= 0 && f->type != FD_INODE)
+    return -1;
+  for(k = 0; k < n; k++)
+    vmaprefault((uint64)iov[k].iov_base, iov[k].iov_len, 1);
 
   if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
+    tot = piperead(f->pipe, iov, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
-    r = devsw[f->major].read(1, addr, n);
+    // stop at a short read, e.g. the end of a console line.
+    for(k = 0; k < n; k++){
+      r = devsw[f->major].read(1, (uint64)iov[k].iov_base, iov[k].iov_len);
+      if(r < 0)
+        return tot > 0 ? tot : -1;
+      tot += r;
+      if(r < iov[k].iov_len)
+        break;
+    }
   } else if(f->type == FD_INODE){
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
+    o = off < 0 ? f->off : off;
+    for(k = 0; k < n; k++){
+      if((r = readi(f->ip, 1, (uint64)iov[k].iov_base, o, iov[k].iov_len)) < 0)
+        break;
+      o += r;
+      tot += r;
+      if(r < iov[k].iov_len)
+        break;
+    }
+    if(off < 0)
+      f->off = o;
     iunlock(f->ip);
+    if(r < 0 && tot == 0)
+      return -1;
   } else {
     panic("fileread");
   }
 
-  return r;
+  return tot;
 }
 
 // Write to file f.
@@ -134,49 +181,99 @@ fileread(struct file *f, uint64 addr, int n)
 int
 filewrite(struct file *f, uint64 addr, int n)
 {
-  int r, ret = 0;
+  struct iovec iov = { (void*)addr, n };
+
+  return filewritev(f, &iov, 1, -1);
+}
+
+// Write the n buffers described by iov, at user virtual
+// addresses, to file f, at f->off (advancing it) if off is -1
+// or at offset off otherwise, as pwrite() does.
+int
+filewritev(struct file *f, struct iovec *iov, int n, int off)
+{
+  int r = 0, k, tot = 0;
 
   if(f->writable == 0)
     return -1;
+  if(off >= 0 && f->type != FD_INODE)
+    return -1;
+  for(k = 0; k < n; k++)
+    vmaprefault((uint64)iov[k].iov_base, iov[k].iov_len, 0);
 
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    tot = pipewrite(f->pipe, iov, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
-    ret = devsw[f->major].write(1, addr, n);
+    for(k = 0; k < n; k++){
+      r = devsw[f->major].write(1, (uint64)iov[k].iov_base, iov[k].iov_len);
+      if(r < 0)
+        return tot > 0 ? tot : -1;
+      tot += r;
+      if(r < iov[k].iov_len)
+        break;
+    }
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
+    // write up to MAXWRITE bytes at a time, each chunk in a
+    // transaction that reserves as much of the log as it may
+    // need (WRITEOPBLOCKS), so as not to exceed the maximum
+    // log transaction size. blocks that the write appends to
+    // the file bypass the log (see writei()), so a streaming
+    // write mostly logs the i-node, bitmap and indirect blocks,
+    // which successive chunks share.
+    // the buffers are written to consecutive offsets, so
+    // small ones can share a transaction and an ilock().
+    int left = 0, i = 0, m, n1 = 0, want;
+    uint o = off;
+    for(k = 0; k < n; k++){
+      if(iov[k].iov_len < 0)
+        return -1;
+      left += iov[k].iov_len;
+    }
+    k = 0;
+    while(k < n){
+      want = left < MAXWRITE ? left : MAXWRITE;
+      begin_opn(WRITEOPBLOCKS(want));
       ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
+      if(off < 0)
+        o = f->off;
+      for(m = 0; k < n; ){
+        if(i == iov[k].iov_len){
+          k++;
+          i = 0;
+          continue;
+        }
+        if(m == want)
+          break;
+        n1 = iov[k].iov_len - i;
+        if(n1 > want - m)
+          n1 = want - m;
+        if((r = writei(f->ip, 1, (uint64)iov[k].iov_base + i, o, n1)) > 0){
+          o += r;
+          m += r;
+          i += r;
+        }
+        if(r != n1)
+          break;
+      }
+      if(off < 0)
+        f->off = o;
       iunlock(f->ip);
-      end_op();
+      end_opn(WRITEOPBLOCKS(want));
+      tot += m;
+      left -= m;
 
       if(r != n1){
         // error from writei
         break;
       }
-      i += r;
     }
-    ret = (i == n ? n : -1);
+    if(k < n)
+      tot = -1;
   } else {
     panic("filewrite");
   }
 
-  return ret;
+  return tot;
 }
-
@@ -26,9 +26,25 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+3];
+
+  uint ranext;        // block (page, for a file) after the last one read
+  uint raend;         // readahead() has started blocks before this
+
+  struct inode *hnext; // itable hash chain
+  struct inode *lnext; // itable LRU list, while ref is 0
+  struct inode *lprev;
 };
 
+// log blocks that writing n bytes to a file may need: each block
+// written and a bitmap block for it, the i-node, an indirect block,
+// and 2 blocks of slop for non-aligned writes.
+#define WRITEOPBLOCKS(n) (2*(((n) + BSIZE - 1) / BSIZE) + 4)
+
+// most bytes to write in one transaction, leaving room in
+// the log for MAXOPBLOCKS of other FS system calls.
+#define MAXWRITE (((LOGSIZE-MAXOPBLOCKS-4) / 2) * BSIZE)
+
 // map major device number to device functions.
 struct devsw {
   int (*read)(int, uint64, int);
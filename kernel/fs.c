@@ -26,6 +26,8 @@
 // only one device
 struct superblock sb; 
 
+static void bitmapinit(int);
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -43,7 +45,10 @@ fsinit(int dev) {
   readsb(dev, &sb);
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
+  if(sb.bsize != BSIZE)
+    panic("file system block size is not BSIZE");
   initlog(dev, &sb);
+  bitmapinit(dev);
 }
 
 // Zero a block.
@@ -59,40 +64,169 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// balloc() avoids reading the whole bitmap with an in-memory
+// summary: the number of free blocks in each bitmap block, so that
+// full ones are skipped without a bread(), and a next-fit hint, the
+// block after the last one allocated. Callers pass a goal, usually
+// the block before the one being allocated in the same file, so
+// that files tend to be laid out contiguously on disk; with no goal
+// the search starts at the hint. The summary is kept exact by
+// updating it whenever a bit changes, with the bitmap block locked.
 
-// Allocate a zeroed disk block.
-// returns 0 if out of disk space.
-static uint
-balloc(uint dev)
+struct {
+  struct spinlock lock;
+  uint nbmap;     // number of bitmap blocks
+  uint *nfree;    // free blocks described by each bitmap block
+  uint *freed;    // newest transaction that freed a block of each
+  uint hint;      // next-fit: where the last search left off
+} bitmap;
+
+// Count the free blocks of each bitmap block.
+// Called by fsinit() after recovery.
+static void
+bitmapinit(int dev)
+{
+  struct buf *bp;
+  uint i, bi, n;
+
+  initlock(&bitmap.lock, "bitmap");
+  bitmap.nbmap = (sb.size + BPB - 1) / BPB;
+  if(bitmap.nbmap * sizeof(uint) > PGSIZE)
+    panic("bitmapinit: too many bitmap blocks");
+  if((bitmap.nfree = (uint*)kalloc()) == 0 ||
+     (bitmap.freed = (uint*)kalloc()) == 0)
+    panic("bitmapinit: kalloc");
+  memset(bitmap.freed, 0, PGSIZE);
+  for(i = 0; i < bitmap.nbmap; i++){
+    bp = bread(dev, sb.bmapstart + i);
+    n = 0;
+    for(bi = 0; bi < BPB && i*BPB + bi < sb.size; bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        n++;
+    brelse(bp);
+    bitmap.nfree[i] = n;
+  }
+  bitmap.hint = 0;
+}
+
+// Look for a free block in bitmap block bp, which describes
+// blocks b through b+BPB-1, at or after bit bi. Returns the bit,
+// or -1 if there is none. Skips whole bytes of allocated blocks.
+static int
+bfind(struct buf *bp, uint b, uint bi)
+{
+  for(; bi < BPB && b + bi < sb.size; bi++){
+    if(bi % 8 == 0 && bp->data[bi/8] == 0xff){
+      bi += 7;
+      continue;
+    }
+    if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+      return bi;
+  }
+  return -1;
+}
+
+// Allocate up to n disk blocks that are contiguous on disk, as
+// soon after block goal as possible (or at the next-fit hint, if
+// goal is 0), and store their addresses in addrs[]. Zeroes them
+// if zero is set. Returns the number allocated, which is less than
+// n if the free block found is followed by fewer than n-1 free
+// blocks, and 0 only if the disk is full.
+static int
+balloc_range(uint dev, uint goal, uint *addrs, int n, int zero)
 {
-  int b, bi, m;
   struct buf *bp;
+  uint b, start, i;
+  int bi, k;
+
+  acquire(&bitmap.lock);
+  start = goal ? goal + 1 : bitmap.hint;
+  release(&bitmap.lock);
+  if(start >= sb.size)
+    start = 0;
+
+  // visit each bitmap block once, starting with start's, and
+  // come back to the start of start's block at the end.
+  for(i = 0; i <= bitmap.nbmap; i++){
+    b = (start / BPB + i) % bitmap.nbmap * BPB;
+    acquire(&bitmap.lock);
+    int empty = bitmap.nfree[b / BPB] == 0;
+    release(&bitmap.lock);
+    if(empty)
+      continue;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
     bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+    bi = bfind(bp, b, i == 0 ? start % BPB : 0);
+    if(bi < 0){
+      brelse(bp);
+      continue;
+    }
+    for(k = 0; k < n && bi + k < BPB && b + bi + k < sb.size; k++){
+      uint m = 1 << ((bi + k) % 8);
+      if(bp->data[(bi + k)/8] & m)
+        break;
+      bp->data[(bi + k)/8] |= m;  // Mark block in use.
+      addrs[k] = b + bi + k;
     }
+    log_write(bp);
+    acquire(&bitmap.lock);
+    bitmap.nfree[b / BPB] -= k;
+    bitmap.hint = b + bi + k;
+    release(&bitmap.lock);
     brelse(bp);
+    for(int j = 0; zero && j < k; j++)
+      bzero(dev, addrs[j]);
+    return k;
   }
   printf("balloc: out of blocks\n");
   return 0;
 }
 
+// Allocate a zeroed disk block, soon after goal if possible.
+// returns 0 if out of disk space.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint addr;
+
+  if(balloc_range(dev, goal, &addr, 1, 1) == 0)
+    return 0;
+  return addr;
+}
+
+// Allocate blocks for the zero entries of addrs[], the addresses
+// of consecutive blocks of a file, in runs of contiguous blocks,
+// each run following the block before it in the file (goal for
+// the first), zeroed if zero is set. Returns the number of leading
+// entries filled in, which is less than n only if out of disk space.
+static int
+bfill(uint dev, uint goal, uint *addrs, int n, int zero)
+{
+  int k, j, got;
+
+  for(k = 0; k < n; ){
+    if(addrs[k]){
+      goal = addrs[k++];
+      continue;
+    }
+    for(j = k; j < n && addrs[j] == 0; j++)
+      ;
+    if((got = balloc_range(dev, goal, addrs + k, j - k, zero)) == 0)
+      return k;
+    k += got;
+    goal = addrs[k-1];
+  }
+  return n;
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
 {
   struct buf *bp;
   int bi, m;
+  uint seq;
 
   bp = bread(dev, BBLOCK(b, sb));
   bi = b % BPB;
@@ -101,9 +235,30 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  seq = log_opseq();
+  acquire(&bitmap.lock);
+  bitmap.nfree[b / BPB]++;
+  bitmap.freed[b / BPB] = seq;
+  release(&bitmap.lock);
   brelse(bp);
 }
 
+// May block b, just allocated, be written straight home? Not if
+// a transaction that hasn't committed yet freed it: a crash would
+// give it back to the file that held it. bfree() keeps track only
+// of the bitmap block, so this says no for any block near a block
+// freed in the last few ticks.
+static int
+bcommitted(uint b)
+{
+  uint seq;
+
+  acquire(&bitmap.lock);
+  seq = bitmap.freed[b / BPB];
+  release(&bitmap.lock);
+  return log_committed(seq);
+}
+
 // Inodes.
 //
 // An inode describes a single unnamed file.
@@ -164,29 +319,116 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
+// In-memory inodes are allocated from a slab cache on demand,
+// up to a limit set at boot from the amount of free memory, and
+// found by hashing (dev, inum). An inode whose last reference
+// is dropped stays in the table, still valid, on an LRU list,
+// so that another iget() of it need not read it from disk.
+// iget() recycles the least recently used of these once the
+// table is at its limit, and ishrink() frees them, down to
+// NINODE inodes, when memory runs low.
+//
 // The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// entries, the hash chains and the LRU list. Since ip->ref
+// indicates whether an entry is in use, and ip->dev and ip->inum
+// indicate which i-node an entry holds, one must hold itable.lock
+// while using any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
+// dev, inum, and the list links.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 127  // prime, so that inode numbers spread out
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmem_cache *cache;
+  int n;                       // inodes allocated
+  int max;                     // limit on n
+  struct inode *hash[NIHASH];  // chains through hnext
+  struct inode lru;            // unreferenced inodes, most recent first
 } itable;
 
+static uint64 ishrink(uint64);
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  itable.cache = kmem_cache_create("inode", sizeof(struct inode));
+  itable.lru.lnext = &itable.lru;
+  itable.lru.lprev = &itable.lru;
+
+  // let the table grow to a sixty-fourth of free memory.
+  itable.max = kfreepages() / 64 * (PGSIZE / sizeof(struct inode));
+  if(itable.max < NINODE)
+    itable.max = NINODE;
+
+  kshrinker(ishrink);
+}
+
+static int
+ihash(uint dev, uint inum)
+{
+  return (dev * 31 + inum) % NIHASH;
+}
+
+// Remove ip from its hash chain.
+// Caller must hold itable.lock.
+static void
+iunhash(struct inode *ip)
+{
+  struct inode **pp;
+
+  for(pp = &itable.hash[ihash(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->hnext)
+    ;
+  *pp = ip->hnext;
+}
+
+static void
+lru_remove(struct inode *ip)
+{
+  ip->lprev->lnext = ip->lnext;
+  ip->lnext->lprev = ip->lprev;
+}
+
+static void
+lru_push(struct inode *ip)
+{
+  ip->lnext = itable.lru.lnext;
+  ip->lprev = &itable.lru;
+  itable.lru.lnext->lprev = ip;
+  itable.lru.lnext = ip;
+}
+
+// Shrinker, called by kalloc() when memory is low: free about
+// n pages' worth of the least recently used unreferenced inodes,
+// keeping at least NINODE. Returns 0, since the inodes go back
+// to the slab allocator, whose shrinker frees the pages.
+static uint64
+ishrink(uint64 n)
+{
+  struct inode *ip;
+  uint64 nfree = 0;
+
+  push_off();
+  int busy = holding(&itable.lock);  // e.g. iget() is allocating
+  pop_off();
+  if(busy)
+    return 0;
+
+  acquire(&itable.lock);
+  while(nfree < n * (PGSIZE / sizeof(struct inode)) && itable.n > NINODE){
+    if((ip = itable.lru.lprev) == &itable.lru)
+      break;
+    lru_remove(ip);
+    iunhash(ip);
+    kmem_cache_free(itable.cache, ip);
+    itable.n--;
+    nfree++;
   }
+  release(&itable.lock);
+  return 0;
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -246,31 +488,41 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
+  int h = ihash(dev, inum);
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = itable.hash[h]; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        lru_remove(ip);
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
+  // Allocate a new entry, or recycle the least recently used.
+  ip = 0;
+  if(itable.n < itable.max && (ip = kmem_cache_alloc(itable.cache)) != 0){
+    initsleeplock(&ip->lock, "inode");
+    itable.n++;
+  } else if((ip = itable.lru.lprev) != &itable.lru){
+    lru_remove(ip);
+    iunhash(ip);
+  } else {
     panic("iget: no inodes");
+  }
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ranext = 0;
+  ip->raend = 0;
+  ip->hnext = itable.hash[h];
+  itable.hash[h] = ip;
   release(&itable.lock);
 
   return ip;
@@ -327,8 +579,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode table entry goes
+// on the LRU list, and can be recycled.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -347,6 +599,8 @@ iput(struct inode *ip)
 
     release(&itable.lock);
 
+    if(ip->type == T_DIR)
+      dcache_purge(ip);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
@@ -357,7 +611,8 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0)
+    lru_push(ip);
   release(&itable.lock);
 }
 
@@ -374,82 +629,267 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
-
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
-// returns 0 if out of disk space.
-static uint
-bmap(struct inode *ip, uint bn)
+// listed in the indirect block ip->addrs[NDIRECT]. The next
+// NINDIRECT*NINDIRECT are reached through the double-indirect
+// block ip->addrs[NDIRECT+1], which lists indirect blocks, and
+// the rest through the triple-indirect block ip->addrs[NDIRECT+2],
+// which lists double-indirect blocks.
+
+// Look up the disk addresses of up to n blocks of inode ip,
+// starting with the bnth, into addrs[]. Stops early at the end
+// of the direct blocks or of the indirect block that maps bn,
+// so that a call reads each level of indirect blocks once.
+// If a block is missing, bmapn allocates one if alloc is set,
+// and otherwise stores 0. Returns the number of addresses
+// stored, which is 0 (or short) only if out of disk space.
+// Missing blocks are allocated in runs with balloc_range(), each
+// placed after the block before it in the file if possible.
+// Allocated data blocks are zeroed, unless alloc is 2, for a
+// caller that will write them whole. If fresh is not 0, bmapn
+// sets bit k of *fresh if addrs[k] was allocated (so n must be
+// at most 32).
+static int
+bmapn(struct inode *ip, uint bn, uint *addrs, int n, int alloc, uint *fresh)
 {
-  uint addr, *a;
+  uint addr, span, *a;
   struct buf *bp;
+  int level, k, dirty;
 
+  if(fresh)
+    *fresh = 0;
   if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[bn] = addr;
+    n = min(n, NDIRECT - bn);
+    for(k = 0; k < n; k++){
+      addrs[k] = ip->addrs[bn + k];
+      if(fresh && addrs[k] == 0)
+        *fresh |= 1 << k;
     }
-    return addr;
+    if(alloc)
+      n = bfill(ip->dev, bn ? ip->addrs[bn-1] : 0, addrs, n, alloc == 1);
+    for(k = 0; k < n; k++)
+      ip->addrs[bn + k] = addrs[k];
+    return n;
   }
   bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
+  // find the tree that maps bn: level 1 is the indirect
+  // block, 2 the double- and 3 the triple-indirect block.
+  span = NINDIRECT;
+  for(level = 1; bn >= span; level++){
+    if(level == 3)
+      panic("bmap: out of range");
+    bn -= span;
+    span *= NINDIRECT;
+  }
+
+  // Load the top block of the tree, allocating if necessary.
+  if((addr = ip->addrs[NDIRECT+level-1]) == 0){
+    if(!alloc){
+      addrs[0] = 0;
+      return 1;
     }
+    addr = balloc(ip->dev, ip->addrs[NDIRECT-1]);
+    if(addr == 0)
+      return 0;
+    ip->addrs[NDIRECT+level-1] = addr;
+  }
+
+  // Walk down to the indirect block that maps bn.
+  for(; level > 1; level--){
+    span /= NINDIRECT;
     bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
+    a = (uint*)bp->data + bn / span;
+    bn %= span;
+    if((addr = *a) == 0 && alloc){
+      addr = balloc(ip->dev, bp->blockno);
       if(addr){
-        a[bn] = addr;
+        *a = addr;
         log_write(bp);
       }
     }
     brelse(bp);
-    return addr;
+    if(addr == 0){
+      if(alloc)
+        return 0;
+      addrs[0] = 0;
+      return 1;
+    }
+  }
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  n = min(n, NINDIRECT - bn);
+  for(k = 0; k < n; k++){
+    addrs[k] = a[bn + k];
+    if(fresh && addrs[k] == 0)
+      *fresh |= 1 << k;
   }
+  if(alloc)
+    n = bfill(ip->dev, bn ? a[bn-1] : addr, addrs, n, alloc == 1);
+  dirty = 0;
+  for(k = 0; k < n; k++){
+    if(a[bn + k] != addrs[k]){
+      a[bn + k] = addrs[k];
+      dirty = 1;
+    }
+  }
+  if(dirty)
+    log_write(bp);
+  brelse(bp);
+  return n;
+}
+
+// The block addresses of a run of blocks of a file, so that
+// readi() and writei() call bmapn() once per run.
+#define NWINDOW 16
+struct bwindow {
+  uint bn;               // first block
+  int n;                 // number of addresses in addr[]
+  uint addr[NWINDOW];
+  uint fresh;            // bit k: addr[k] was just allocated
+};
+
+// Return the disk block address of block bn of ip, from w if it
+// holds bn, or else refilling w with the addresses of bn
+// through at most last. Returns 0 if out of disk space.
+static uint
+bwindow(struct inode *ip, struct bwindow *w, uint bn, uint last, int alloc)
+{
+  if(w->n == 0 || bn < w->bn || bn >= w->bn + w->n){
+    w->bn = bn;
+    w->n = bmapn(ip, bn, w->addr, min(last - bn + 1, NWINDOW), alloc, &w->fresh);
+    if(w->n == 0)
+      return 0;
+  }
+  return w->addr[bn - w->bn];
+}
 
-  panic("bmap: out of range");
+// Blocks each transaction of itrunc() may log besides the
+// i-node and the (at most three) indirect blocks it stops in.
+// The first one leaves room for what the caller logged before.
+#define TRUNCBLOCKS (MAXOPBLOCKS - 4)
+
+// Progress of one itrunc() transaction: how many more bitmap
+// blocks it may log, the bitmap block bfree() logged last, and
+// the lowest file block number it has freed.
+struct trunc {
+  int n;
+  uint bmap;
+  uint end;
+};
+
+// Free block b for itrunc(), unless that would log
+// one bitmap block too many. Returns 0 if it didn't.
+static int
+tfree(uint dev, uint b, struct trunc *t)
+{
+  if(BBLOCK(b, sb) != t->bmap){
+    if(t->n == 0)
+      return 0;
+    t->n--;
+    t->bmap = BBLOCK(b, sb);
+  }
+  bfree(dev, b);
+  return 1;
+}
+
+// Free the blocks below indirect block addr, which is level
+// levels of indirection above the data blocks and maps file
+// blocks from base on, last first, and then addr itself.
+// Returns 1 if it got that far, or 0 if it ran out of t's
+// budget, leaving addr holding the blocks before.
+static int
+ifree(uint dev, uint addr, int level, uint base, struct trunc *t)
+{
+  struct buf *bp;
+  uint *a, span;
+  int j, ok, dirty;
+
+  span = 1;
+  for(j = 1; j < level; j++)
+    span *= NINDIRECT;
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  dirty = 0;
+  for(j = NINDIRECT - 1; j >= 0; j--){
+    if(a[j] == 0)
+      continue;
+    if(level > 1)
+      ok = ifree(dev, a[j], level - 1, base + j*span, t);
+    else
+      ok = tfree(dev, a[j], t);
+    if(!ok)
+      break;
+    a[j] = 0;
+    dirty = 1;
+    t->end = base + j*span;
+  }
+  if(j < 0 && tfree(dev, addr, t)){
+    brelse(bp);
+    return 1;
+  }
+  if(dirty)
+    log_write(bp);
+  brelse(bp);
+  return 0;
 }
 
 // Truncate inode (discard contents).
-// Caller must hold ip->lock.
+// Frees the blocks from the end of the file, a bounded number
+// per transaction so that large files don't overflow the log;
+// between transactions the i-node is written with the blocks
+// and size still left, and ip->lock is released so that ops
+// waiting for it can finish and let the log commit.
+// Caller must hold ip->lock and be inside a transaction.
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
-
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
+  static const uint base[3] = {
+    NDIRECT, NDIRECT + NINDIRECT, NDIRECT + NINDIRECT + NINDIRECT*NINDIRECT
+  };
+  struct trunc t;
+  int i, done, first;
+
+  for(first = 1; ; first = 0){
+    t.n = first ? TRUNCBLOCKS - 4 : TRUNCBLOCKS;
+    t.bmap = 0;
+    t.end = MAXFILE;
+    done = 1;
+    for(i = 2; i >= 0 && done; i--){
+      if(ip->addrs[NDIRECT+i] == 0)
+        continue;
+      if(ifree(ip->dev, ip->addrs[NDIRECT+i], i + 1, base[i], &t))
+        ip->addrs[NDIRECT+i] = 0;
+      else
+        done = 0;
+    }
+    for(i = NDIRECT - 1; i >= 0 && done; i--){
+      if(ip->addrs[i] == 0)
+        continue;
+      if(!tfree(ip->dev, ip->addrs[i], &t)){
+        done = 0;
+        continue;
+      }
       ip->addrs[i] = 0;
+      t.end = i;
     }
-  }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+    if(done)
+      t.end = 0;
+    if((uint64)t.end * BSIZE < ip->size){
+      if(ip->type == T_FILE)
+        pcache_trunc(ip, t.end * BSIZE);
+      ip->size = t.end * BSIZE;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
-  }
+    iupdate(ip);
+    if(done)
+      break;
 
-  ip->size = 0;
-  iupdate(ip);
+    releasesleep(&ip->lock);
+    end_op();
+    begin_op();
+    acquiresleep(&ip->lock);
+  }
 }
 
 // Copy stat information from inode.
@@ -464,26 +904,122 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Called by readi() for a read of blocks bn through last of ip.
+// If reads of ip look sequential, start reading up to NREADAHEAD
+// blocks past last into the buffer cache, so that the disk works
+// on them while readi() copies out the blocks before them.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn, uint last)
+{
+  uint b, end, addr[NREADAHEAD];
+  int n, i;
+
+  if(bn != 0 && bn != ip->ranext && bn + 1 != ip->ranext){
+    // not sequential.
+    ip->ranext = last + 1;
+    ip->raend = 0;
+    return;
+  }
+  ip->ranext = last + 1;
+
+  if(ip->size == 0)
+    return;
+  end = last + NREADAHEAD;
+  if(end > (ip->size - 1) / BSIZE)
+    end = (ip->size - 1) / BSIZE;
+  b = bn + 1;
+  if(b < ip->raend)
+    b = ip->raend;  // already started on earlier calls
+  while(b <= end){
+    n = bmapn(ip, b, addr, min(end - b + 1, NREADAHEAD), 0, 0);
+    for(i = 0; i < n; i++)
+      if(addr[i] != 0)
+        bread_async(ip->dev, addr[i]);
+    b += n;
+  }
+  bkick();
+  if(end + 1 > ip->raend)
+    ip->raend = end + 1;
+}
+
+// Read pages pgno through pgno+n-1 of ip into pa[0..n-1], for the
+// page cache. Blocks the file doesn't have, and bytes past its end,
+// read as zeros. The blocks are read in batches of NREADAHEAD, so
+// that the disk sees runs of adjacent blocks together.
+// Caller must hold ip->lock.
+void
+readpages(struct inode *ip, uint pgno, char **pa, int n)
+{
+  uint addr[NREADAHEAD], a[NREADAHEAD], bn, end;
+  uchar *dst[NREADAHEAD];
+  int i, k, m, nb;
+
+  nb = 0;
+  for(i = 0; i < n; i++){
+    memset(pa[i], 0, PGSIZE);
+    bn = (pgno + i) * (PGSIZE / BSIZE);
+    end = min(bn + PGSIZE / BSIZE, (ip->size + BSIZE - 1) / BSIZE);
+    while(bn < end){
+      if(nb == NREADAHEAD){
+        bread_direct(ip->dev, addr, dst, nb);
+        nb = 0;
+      }
+      m = bmapn(ip, bn, a, min(end - bn, NREADAHEAD - nb), 0, 0);
+      for(k = 0; k < m; k++, bn++){
+        if(a[k] == 0)
+          continue;  // a hole
+        addr[nb] = a[k];
+        dst[nb++] = (uchar*)pa[i] + (bn % (PGSIZE / BSIZE)) * BSIZE;
+      }
+    }
+  }
+  bread_direct(ip->dev, addr, dst, nb);
+
+  // the last block may have bytes past the end of the file.
+  for(i = 0; i < n; i++)
+    if(pgno + i == ip->size / PGSIZE)
+      memset(pa[i] + ip->size % PGSIZE, 0, PGSIZE - ip->size % PGSIZE);
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
+// File data comes from the page cache, or from the buffer cache
+// if there is no memory for pages; directories always come from
+// the buffer cache.
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, last;
   struct buf *bp;
+  struct bwindow w;
+  int r;
 
   if(off > ip->size || off + n < off)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
 
-  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    uint addr = bmap(ip, off/BSIZE);
+  tot = 0;
+  if(ip->type == T_FILE){
+    if((r = pcache_read(ip, user_dst, dst, off, n)) < 0)
+      return -1;
+    tot = r;
+    off += tot;
+    dst += tot;
+  }
+
+  last = (off + n - tot - 1) / BSIZE;
+  w.n = 0;
+  for(; tot<n; tot+=m, off+=m, dst+=m){
+    uint addr = bwindow(ip, &w, off/BSIZE, last, 1);
     if(addr == 0)
       break;
     bp = bread(ip->dev, addr);
+    if(tot == 0)
+      readahead(ip, off/BSIZE, last);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
@@ -495,6 +1031,16 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Wait for the writes of bufs[0..n-1] and release them.
+static void
+bwaitall(struct buf **bufs, int n)
+{
+  for(int i = 0; i < n; i++){
+    bwait(bufs[i]);
+    brelse(bufs[i]);
+  }
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -502,36 +1048,95 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 // Returns the number of bytes successfully written.
 // If the return value is less than the requested n,
 // there was an error of some kind.
+//
+// A block that the write adds to a file is built whole, without
+// reading or zeroing it first, and written straight to its home
+// location rather than through the log. writei() waits for those
+// writes before it returns, and so before the transaction that
+// adds the blocks to the file can commit; a crash before then
+// leaves them free. Only if the log still pins the block (it held
+// something else not yet checkpointed) is it logged instead, so
+// that a checkpoint or recovery can't write over it, or if the
+// transaction that freed it may not have committed yet (see
+// bcommitted()), since the file that held it would get it back.
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
-  struct buf *bp;
+  uint tot, m, last;
+  struct buf *bp, *direct[NWINDOW];
+  struct bwindow w;
+  int nd = 0, fresh, bad;
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  last = (off + n - 1) / BSIZE;
+  w.n = 0;
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    uint addr = bmap(ip, off/BSIZE);
+    uint addr = bwindow(ip, &w, off/BSIZE, last, ip->type == T_FILE ? 2 : 1);
     if(addr == 0)
       break;
-    bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
+    fresh = ip->type == T_FILE && (w.fresh & (1 << (off/BSIZE - w.bn)));
+    if(fresh){
+      bp = bclaim(ip->dev, addr);
+      memset(bp->data, 0, BSIZE);
+      bp->valid = 1;
+    } else {
+      bp = bread(ip->dev, addr);
+    }
+    bad = either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1;
+    if(bad && !fresh){
       brelse(bp);
       break;
     }
-    log_write(bp);
-    brelse(bp);
+    if(bad){
+      // the block is in the file now, so it must be written.
+      memset(bp->data, 0, BSIZE);
+    } else if(ip->type == T_FILE){
+      pcache_write(ip, off, bp->data + (off % BSIZE), m);
+    }
+    if(fresh && bp->pins == 0 && bcommitted(addr)){
+      // only log_write() pins a block, and only ip's
+      // holder writes this one, so pins stays 0.
+      bwrite_async(bp);
+      direct[nd++] = bp;
+      if(nd == NWINDOW){
+        bwaitall(direct, nd);
+        nd = 0;
+      }
+    } else {
+      log_write(bp);
+      brelse(bp);
+    }
+    if(bad)
+      break;
+  }
+  bwaitall(direct, nd);
+
+  // if the write stopped early, the blocks of the window after
+  // the one it stopped in are in the file but weren't written;
+  // zero them, lest a later partial write or an mmap() of the
+  // last page show what a deleted file left in them.
+  if(tot < n && ip->type == T_FILE){
+    for(uint bn = off/BSIZE + 1; bn < w.bn + w.n; bn++){
+      if((w.fresh & (1 << (bn - w.bn))) == 0)
+        continue;
+      bp = bclaim(ip->dev, w.addr[bn - w.bn]);
+      memset(bp->data, 0, BSIZE);
+      bp->valid = 1;
+      log_write(bp);
+      brelse(bp);
+    }
   }
 
   if(off > ip->size)
     ip->size = off;
 
   // write the i-node back to disk even if the size didn't change
-  // because the loop above might have called bmap() and added a new
+  // because the loop above might have called bmapn() and added a new
   // block to ip->addrs[].
   iupdate(ip);
 
@@ -539,6 +1144,17 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 }
 
 // Directories
+//
+// A directory is a file containing a sequence of dirents. A
+// small one is searched linearly. When one that fills exactly its
+// first block needs another entry, dirlink() converts it to a
+// hashed directory (see struct dirindex in fs.h), which is what
+// mkfs makes of a directory too big for one block. A lookup in a
+// hashed directory reads the index and one leaf. When a leaf is
+// full, dirsplit() moves about half of its entries to a new leaf
+// (extendible hashing), so a create costs the same however large
+// the directory is. Directories of more than one block made
+// before, or by an older mkfs, stay linear.
 
 int
 namecmp(const char *s, const char *t)
@@ -546,17 +1162,110 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// FNV-1a hash of a directory entry name.
+// mkfs/mkfs.c has a copy.
+static uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Return a locked buf with block fb of directory dp.
+static struct buf*
+dirblock(struct inode *dp, uint fb)
+{
+  uint addr;
+
+  if(bmapn(dp, fb, &addr, 1, 0, 0) != 1 || addr == 0)
+    panic("dirblock");
+  return bread(dp->dev, addr);
+}
+
+// If dp is a hashed directory, return a locked buf
+// with its index block; otherwise return 0.
+static struct buf*
+dirindex(struct inode *dp)
+{
+  struct buf *bp;
+  struct dirindex *ix;
+
+  if(dp->size < 2*BSIZE)
+    return 0;
+  bp = dirblock(dp, 0);
+  ix = (struct dirindex*)bp->data;
+  if(ix->zero != 0 || memcmp(ix->magic, DIRMAGIC, sizeof(ix->magic)) != 0){
+    brelse(bp);
+    return 0;
+  }
+  return bp;
+}
+
+// Is dp a hashed directory?
+// Caller must hold dp->lock.
+int
+dirhashed(struct inode *dp)
+{
+  struct buf *bp;
+
+  if((bp = dirindex(dp)) == 0)
+    return 0;
+  brelse(bp);
+  return 1;
+}
+
+// The leaf of hashed directory ix that holds name.
+static uint
+dirleaf(struct dirindex *ix, char *name)
+{
+  return DIRLEAF(ix, dirhash(name) & ((1 << ix->depth) - 1));
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
-  struct dirent de;
+  uint off, inum, lb;
+  struct dirent de, *d;
+  struct buf *bp;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dcache_lookup(dp, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
+  if((bp = dirindex(dp)) != 0){
+    lb = dirleaf((struct dirindex*)bp->data, name);
+    brelse(bp);
+    bp = dirblock(dp, lb);
+    for(d = (struct dirent*)bp->data; d < (struct dirent*)(bp->data + BSIZE); d++){
+      if(d->inum != 0 && namecmp(name, d->name) == 0){
+        off = lb*BSIZE + (d - (struct dirent*)bp->data)*sizeof(*d);
+        inum = d->inum;
+        brelse(bp);
+        if(poff)
+          *poff = off;
+        dcache_enter(dp, name, inum, off);
+        return iget(dp->dev, inum);
+      }
+    }
+    brelse(bp);
+    dcache_enter(dp, name, 0, 0);
+    return 0;
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -567,13 +1276,151 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcache_enter(dp, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcache_enter(dp, name, 0, 0);
+  return 0;
+}
+
+// Add a zeroed block to the end of directory dp, and
+// return a locked buf for it, or 0 if out of disk space.
+static struct buf*
+dirgrow(struct inode *dp)
+{
+  uint addr;
+
+  if(bmapn(dp, dp->size / BSIZE, &addr, 1, 1, 0) != 1)
+    return 0;
+  dp->size += BSIZE;
+  iupdate(dp);
+  return bread(dp->dev, addr);  // balloc() zeroed it
+}
+
+// Turn dp, a linear directory that fills its first block,
+// into a hashed directory with one leaf, block 1.
+// Returns 0 on success, -1 if out of disk space.
+static int
+dirconvert(struct inode *dp)
+{
+  struct buf *ixb, *leaf;
+  struct dirindex *ix;
+  struct dirent *d;
+
+  if((leaf = dirgrow(dp)) == 0)
+    return -1;
+  ixb = dirblock(dp, 0);
+  memmove(leaf->data, ixb->data, BSIZE);
+  for(d = (struct dirent*)leaf->data; d < (struct dirent*)(leaf->data + BSIZE); d++)
+    if(d->inum != 0)
+      dcache_enter(dp, d->name, d->inum, BSIZE + (d - (struct dirent*)leaf->data)*sizeof(*d));
+
+  memset(ixb->data, 0, BSIZE);
+  ix = (struct dirindex*)ixb->data;
+  memmove(ix->magic, DIRMAGIC, sizeof(ix->magic));
+  ix->depth = 0;
+  DIRLEAF(ix, 0) = 1;
+  log_write(leaf);
+  log_write(ixb);
+  brelse(leaf);
+  brelse(ixb);
   return 0;
 }
 
+// Split leaf lb of hashed directory dp, which is full:
+// move the entries whose hashes have the next bit set to a
+// new leaf, doubling the index first if only one slot points
+// to lb. Returns 0 on success, -1 if the directory cannot grow.
+static int
+dirsplit(struct inode *dp, uint lb)
+{
+  struct buf *ixb, *old, *new;
+  struct dirindex *ix;
+  struct dirent *d, *nd;
+  uint n, i, cnt, bit, nb;
+
+  ixb = dirblock(dp, 0);
+  ix = (struct dirindex*)ixb->data;
+  n = 1 << ix->depth;
+  cnt = 0;
+  for(i = 0; i < n; i++)
+    if(DIRLEAF(ix, i) == lb)
+      cnt++;
+  if((cnt == 1 && ix->depth == DIRMAXDEPTH) || (new = dirgrow(dp)) == 0){
+    brelse(ixb);
+    return -1;
+  }
+  nb = dp->size/BSIZE - 1;
+
+  if(cnt == 1){
+    // double the index.
+    for(i = 0; i < n; i++)
+      DIRLEAF(ix, n + i) = DIRLEAF(ix, i);
+    ix->depth++;
+    n *= 2;
+    cnt = 2;
+  }
+  // the slots of lb agree in their low log2(n/cnt) bits;
+  // the next bit decides between lb and nb.
+  bit = n / cnt;
+  for(i = 0; i < n; i++)
+    if(DIRLEAF(ix, i) == lb && (i & bit))
+      DIRLEAF(ix, i) = nb;
+
+  old = dirblock(dp, lb);
+  d = (struct dirent*)old->data;
+  nd = (struct dirent*)new->data;
+  for(i = 0; i < BSIZE/sizeof(*d); i++){
+    if(d[i].inum != 0 && (dirhash(d[i].name) & bit)){
+      nd[i] = d[i];
+      memset(&d[i], 0, sizeof(d[i]));
+      dcache_enter(dp, nd[i].name, nd[i].inum, nb*BSIZE + i*sizeof(*d));
+    }
+  }
+  log_write(old);
+  log_write(new);
+  log_write(ixb);
+  brelse(old);
+  brelse(new);
+  brelse(ixb);
+  return 0;
+}
+
+// Write a new directory entry (name, inum) into the hashed
+// directory dp. Returns 0 on success, -1 on failure.
+static int
+dirlinkhashed(struct inode *dp, char *name, uint inum)
+{
+  struct buf *ixb, *bp;
+  struct dirent *d;
+  uint lb, off;
+
+  // split at most once, to stay within the blocks
+  // that an FS operation may write to the log.
+  for(int split = 0; ; split++){
+    ixb = dirindex(dp);
+    lb = dirleaf((struct dirindex*)ixb->data, name);
+    brelse(ixb);
+    bp = dirblock(dp, lb);
+    for(d = (struct dirent*)bp->data; d < (struct dirent*)(bp->data + BSIZE); d++){
+      if(d->inum == 0){
+        strncpy(d->name, name, DIRSIZ);
+        d->inum = inum;
+        off = lb*BSIZE + (d - (struct dirent*)bp->data)*sizeof(*d);
+        log_write(bp);
+        brelse(bp);
+        dcache_enter(dp, name, inum, off);
+        return 0;
+      }
+    }
+    brelse(bp);
+    if(split || dirsplit(dp, lb) < 0)
+      return -1;
+  }
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
 // Returns 0 on success, -1 on failure (e.g. out of disk blocks).
 int
@@ -589,6 +1436,9 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  if(dirhashed(dp))
+    return dirlinkhashed(dp, name, inum);
+
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -597,10 +1447,18 @@ dirlink(struct inode *dp, char *name, uint inum)
       break;
   }
 
+  if(off == BSIZE && dp->size == BSIZE){
+    // outgrowing the first block: switch to hashing.
+    if(dirconvert(dp) < 0)
+      return -1;
+    return dirlinkhashed(dp, name, inum);
+  }
+
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     return -1;
+  dcache_enter(dp, name, inum, off);
 
   return 0;
 }
@@ -3,7 +3,9 @@
 
 
 #define ROOTINO  1   // root i-number
-#define BSIZE 1024  // block size
+#ifndef BSIZE
+#define BSIZE 1024  // block size; make BSIZE=4096 for 4 KB blocks
+#endif
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
@@ -20,13 +22,15 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint bsize;        // Block size (bytes), must be BSIZE
 };
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+#define NDIRECT 10
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NINDIRECT*NINDIRECT + \
+                 NINDIRECT*NINDIRECT*NINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +39,7 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NDIRECT+3];   // Data block addresses
 };
 
 // Inodes per block.
@@ -58,3 +62,25 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// A directory that has outgrown its first block is hashed: block 0
+// is an index, and the dirents are in leaf blocks after it. Slot
+// dirhash(name) % (1 << depth) of the index holds the number of
+// the leaf block for name. The index is laid out as dirents with
+// inum 0, so that programs that read a directory skip it.
+#define DIRMAGIC    "dirhash"
+#define DIRMAXDEPTH 8   // at most 1 << DIRMAXDEPTH leaves
+#define DIRNLEAF    7   // leaf numbers per 16-byte record
+
+struct dirindex {
+  ushort zero;          // where a linear directory has "."
+  char magic[8];        // DIRMAGIC
+  ushort depth;
+  char pad[4];
+  struct {
+    ushort zero;
+    ushort leaf[DIRNLEAF];
+  } rec[BSIZE / sizeof(struct dirent) - 1];
+};
+
+#define DIRLEAF(ix, s) ((ix)->rec[(s) / DIRNLEAF].leaf[(s) % DIRNLEAF])
+
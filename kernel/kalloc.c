@@ -1,6 +1,24 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers.
+//
+// A binary buddy allocator. Free memory is kept in blocks of
+// 2^order contiguous pages, for order 0..MAXORDER, each block
+// aligned to its own size. kalloc_order(k) splits a larger block
+// if no block of order k is free; kfree() merges a freed block
+// with its buddy as long as the buddy is free too.
+// kalloc() is the common single-page case and takes a page
+// straight off the order-0 list when one is available.
+//
+// Each allocated block has a reference count, so that pages can be
+// shared, e.g. between a parent and child after a copy-on-write
+// fork(). kalloc() returns a block with one reference, kdup() adds
+// one, and kfree() drops one, freeing the block when none are left.
+//
+// Other parts of the kernel that cache memory (e.g. the slab
+// allocator) register shrinkers with kshrinker(). When an allocation
+// fails, or the number of free pages falls below a low watermark,
+// kalloc asks the shrinkers to give pages back.
 
 #include "types.h"
 #include "param.h"
@@ -8,26 +26,79 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "memstat.h"
 
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+// number of physical pages between KERNBASE and PHYSTOP.
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2PG(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define PG2PA(pg) (KERNBASE + (uint64)(pg) * PGSIZE)
+
+// per-page state, kept for the first page of each block.
+#define PG_FREE   0x80  // first page of a block on a free list
+#define PG_ALLOC  0x40  // first page of an allocated block
+#define PG_ORDER  0x0f  // order of the block
+
+#define NSHRINKER 8
+
 struct run {
   struct run *next;
+  struct run *prev;
 };
 
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct run free[MAXORDER+1]; // circular list heads, one per order
+  int nfree[MAXORDER+1];       // number of blocks on each list
+  uchar state[NPAGE];
+  int ref[NPAGE];              // references to each allocated block
+  uint64 nfreepg;              // free pages, on all lists
+  uint64 npg;                  // pages handed to the allocator at boot
+  uint64 low;                  // reclaim when fewer pages than this are free
+  uint64 reclaimed;            // pages given back by shrinkers
+  uint64 (*shrinker[NSHRINKER])(uint64);
+  int nshrinker;
+  int reclaiming;              // a CPU is running the shrinkers
 } kmem;
 
+static void
+addfree(int order, struct run *r)
+{
+  struct run *h = &kmem.free[order];
+
+  r->next = h->next;
+  r->prev = h;
+  h->next->prev = r;
+  h->next = r;
+  kmem.nfree[order]++;
+  kmem.nfreepg += 1L << order;
+  kmem.state[PA2PG(r)] = PG_FREE | order;
+}
+
+static void
+delfree(int order, struct run *r)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  kmem.nfree[order]--;
+  kmem.nfreepg -= 1L << order;
+  kmem.state[PA2PG(r)] = 0;
+}
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  for(int k = 0; k <= MAXORDER; k++){
+    kmem.free[k].next = &kmem.free[k];
+    kmem.free[k].prev = &kmem.free[k];
+  }
   freerange(end, (void*)PHYSTOP);
+  kmem.low = kmem.npg / 64;
 }
 
 void
@@ -35,31 +106,148 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    kmem.state[PA2PG(p)] = PG_ALLOC;  // as if from kalloc()
+    kmem.ref[PA2PG(p)] = 1;
+    kmem.npg++;
     kfree(p);
+  }
+}
+
+// Register a shrinker, a function that frees memory cached
+// elsewhere in the kernel. fn(n) is asked to free about n pages,
+// and returns how many pages it gave back to kfree(); a cache of
+// slab objects returns 0, since the objects it frees go back to
+// their slabs. It is called from kalloc(), so it must not
+// allocate, and must not acquire a lock that the calling CPU
+// already holds (see holding()).
+void
+kshrinker(uint64 (*fn)(uint64))
+{
+  acquire(&kmem.lock);
+  if(kmem.nshrinker >= NSHRINKER)
+    panic("kshrinker");
+  kmem.shrinker[kmem.nshrinker++] = fn;
+  release(&kmem.lock);
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
+// Ask the shrinkers to free about n pages; return how many they freed.
+// The most recently registered run first, since they may be caches
+// built on top of earlier ones (e.g. the buffer cache allocates from
+// the slab allocator). The first registered, the slab allocator's,
+// always runs, and runs last, since only it turns the objects that
+// the others freed into free pages. Only one CPU runs the shrinkers
+// at a time. Others return at once rather than wait, since the
+// reclaiming CPU may be spinning on a lock that they hold.
+static uint64
+kreclaim(uint64 n)
+{
+  uint64 got = 0;
+
+  if(__sync_lock_test_and_set(&kmem.reclaiming, 1) != 0)
+    return 0;
+  for(int i = kmem.nshrinker - 1; i > 0 && got < n; i--)
+    got += kmem.shrinker[i](n - got);
+  if(kmem.nshrinker > 0)
+    got += kmem.shrinker[0](n);
+  __sync_fetch_and_add(&kmem.reclaimed, got);
+  __sync_lock_release(&kmem.reclaiming);
+  return got;
+}
+
+// Reclaim if free memory has fallen below the low watermark.
+static void
+kwatermark(void)
+{
+  uint64 nfree = kmem.nfreepg;
+
+  if(nfree < kmem.low)
+    kreclaim(kmem.low - nfree);
+}
+
+// Drop a reference to the block of physical memory pointed
+// at by pa, which normally should have been returned by a
+// call to kalloc() or kalloc_order(), and free the block if
+// that was the last reference.  (The exception is when
 // initializing the allocator; see kinit above.)
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *buddy;
+  uint64 pg;
+  int order;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  pg = PA2PG(pa);
+  if((kmem.state[pg] & PG_ALLOC) == 0)
+    panic("kfree: not allocated");
+  if(kmem.ref[pg] < 1)
+    panic("kfree: ref");
+  if(__sync_sub_and_fetch(&kmem.ref[pg], 1) > 0)
+    return;
+  order = kmem.state[pg] & PG_ORDER;
+
   // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  memset(pa, 1, PGSIZE << order);
+
+  acquire(&kmem.lock);
+  kmem.state[pg] = 0;
+  for(; order < MAXORDER; order++){
+    // a block's buddy differs from it only in the bit
+    // that corresponds to the block's size.
+    uint64 bpg = pg ^ (1L << order);
+    if(bpg >= NPAGE || kmem.state[bpg] != (PG_FREE | order))
+      break;
+    buddy = (struct run*)PG2PA(bpg);
+    delfree(order, buddy);
+    pg &= ~(1L << order);
+  }
+  r = (struct run*)PG2PA(pg);
+  addfree(order, r);
+  release(&kmem.lock);
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their total size. Returns a pointer that the kernel
+// can use, or 0 if the memory cannot be allocated.
+void *
+kalloc_order(int order)
+{
+  struct run *r;
+  int k, retried = 0;
 
-  r = (struct run*)pa;
+  if(order < 0 || order > MAXORDER)
+    panic("kalloc_order");
 
+again:
   acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  for(k = order; k <= MAXORDER; k++)
+    if(kmem.nfree[k] > 0)
+      break;
+  if(k > MAXORDER){
+    release(&kmem.lock);
+    if(!retried && kreclaim(1L << order) > 0){
+      retried = 1;
+      goto again;
+    }
+    return 0;
+  }
+  r = kmem.free[k].next;
+  delfree(k, r);
+  // split, returning the upper halves to the free lists.
+  while(k > order){
+    k--;
+    addfree(k, (struct run*)((char*)r + (PGSIZE << k)));
+  }
+  kmem.state[PA2PG(r)] = PG_ALLOC | order;
+  kmem.ref[PA2PG(r)] = 1;
   release(&kmem.lock);
+  kwatermark();
+
+  memset((char*)r, 5, PGSIZE << order); // fill with junk
+  return (void*)r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -71,12 +259,86 @@ kalloc(void)
   struct run *r;
 
   acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  r = kmem.free[0].next;
+  if(r != &kmem.free[0]){
+    delfree(0, r);
+    kmem.state[PA2PG(r)] = PG_ALLOC;
+    kmem.ref[PA2PG(r)] = 1;
+  } else {
+    r = 0;
+  }
   release(&kmem.lock);
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+  if(r == 0)
+    return kalloc_order(0);  // split a larger block, or reclaim
+  kwatermark();
+
+  memset((char*)r, 5, PGSIZE); // fill with junk
   return (void*)r;
 }
+
+// Add a reference to the allocated block at pa.
+void
+kdup(void *pa)
+{
+  uint64 pg = PA2PG(pa);
+
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  if((kmem.state[pg] & PG_ALLOC) == 0 || kmem.ref[pg] < 1)
+    panic("kdup: not allocated");
+  __sync_fetch_and_add(&kmem.ref[pg], 1);
+}
+
+// Return the number of references to the allocated block at pa.
+int
+krefcnt(void *pa)
+{
+  return kmem.ref[PA2PG(pa)];
+}
+
+// Return the number of free pages.
+uint64
+kfreepages(void)
+{
+  return kmem.nfreepg;
+}
+
+// Fill in the system-wide fields of *st.
+void
+kmemstat(struct memstat *st)
+{
+  st->freepages = kmem.nfreepg;
+  st->totalpages = kmem.npg;
+  st->reclaimed = kmem.reclaimed;
+}
+
+// Print the free lists and fragmentation statistics to the console.
+// For each order k, "unusable" is the percentage of free memory
+// that sits in blocks too small to satisfy an order-k request.
+// Runs when user types ^F on console.
+void
+kmemdump(void)
+{
+  int nfree[MAXORDER+1];
+  uint64 total, small;
+  int k;
+
+  acquire(&kmem.lock);
+  for(k = 0; k <= MAXORDER; k++)
+    nfree[k] = kmem.nfree[k];
+  release(&kmem.lock);
+
+  total = 0;
+  for(k = 0; k <= MAXORDER; k++)
+    total += (uint64)nfree[k] << k;
+
+  printf("\nfree pages %d of %d, reclaimed %d\n", (int)total,
+         (int)kmem.npg, (int)kmem.reclaimed);
+  small = 0;
+  for(k = 0; k <= MAXORDER; k++){
+    printf("order %d: %d free, unusable %d%%\n", k, nfree[k],
+           total ? (int)(small * 100 / total) : 0);
+    small += (uint64)nfree[k] << k;
+  }
+}
@@ -19,122 +19,302 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the log writer has taken the transaction.
+// begin_op() reserves room for MAXOPBLOCKS blocks; a call
+// that knows it will write more or fewer (e.g. filewrite())
+// reserves that many with begin_opn(n) and ends with end_opn(n).
 //
-// The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
-// Log appends are synchronous.
-
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+// Commits are done by the log writer, a kernel thread, not by
+// end_op(). It lets a transaction collect the operations of
+// LOGDELAY ticks (group commit), unless the log fills up or
+// log_sync() is waiting for it. So a system call's updates
+// reach the disk some time after it returns; fsync() waits
+// for them.
+//
+// The log writer pipelines transactions. It first copies the
+// blocks of a transaction aside, after which FS system calls may
+// go on to fill the next transaction while it writes the copies
+// to the log.
+//
+// Committed blocks are not installed at their home locations
+// right away. The log writer keeps the latest committed copy of
+// each block in a checkpoint table, and the cached block pinned,
+// until a checkpoint writes them all home: when the log has no
+// room for the next transaction, or CKPTDELAY ticks after the
+// last checkpoint. So a block that many transactions modify
+// (a bitmap block, a busy inode block) is written home once.
+// A timed checkpoint's writes go to the disk along with the log
+// writes of the next transaction, if that is ready by then.
+//
+// File data that a write appends doesn't go through the log:
+// writei() writes the new blocks home before its end_op(), so
+// they are on disk before the transaction that adds them to the
+// file commits (ordered data). Such a block must not be one that
+// a checkpoint or recovery could still write; the log keeps every
+// block it may write pinned (bpin()) until the header has moved
+// past it, and writei() logs a pinned block as usual.
+//
+// The log is a physical re-do log containing disk blocks,
+// used as a circular buffer. The on-disk log format:
+//   header block, containing the position of the oldest
+//     transaction not yet installed, and its sequence number
+//   then, from that position on, wrapping around, for each
+//   transaction:
+//     descriptor block, containing the sequence number
+//       and block #s for block A, B, C, ...
+//     block A
+//     block B
+//     block C
+//     ...
+//     commit block, a copy of the descriptor
+// A logged block whose first word is LOGDESC or LOGCOMMIT would
+// look like a descriptor or commit block to recovery, and file
+// data can be anything; so such a block goes to the log with its
+// first word zeroed, and the descriptor keeps the word for it.
+// The commit block is written only after the blocks before it
+// are on disk, and a transaction commits when it gets there.
+// A checkpoint moves the header's position past the transactions
+// whose blocks it wrote home. Recovery replays, in order, the
+// transactions from the header's position on whose descriptor
+// and commit blocks both carry the expected sequence number,
+// writing home just the latest copy of each block.
+
+#define LOGDESC   0x64676f6c  // "logd"
+#define LOGCOMMIT 0x63676f6c  // "logc"
+#define NCKPT     LOGBLOCKS   // entries in the checkpoint table
+
+// Contents of the header block.
+struct loghead {
+  uint tail;  // position of the oldest transaction not installed
+  uint seq;   // its sequence number
+};
+
+// Contents of the descriptor and commit blocks.
+struct logdesc {
+  uint magic;
+  uint seq;
+  int n;
+  int block[LOGSIZE];
+  uint escaped[LOGSIZE];  // first word of the logged block, if zeroed
+};
+
+// Keeps track in memory of logged block# before commit.
 struct logheader {
   int n;
   int block[LOGSIZE];
 };
 
+// The transaction that the log writer is committing.
+struct trans {
+  uint seq;
+  int pos;                      // position of its descriptor block
+  struct logheader lh;
+  struct buf *pinned[LOGSIZE];  // the blocks in the cache
+  struct buf *copy[LOGSIZE+2];  // descriptor, copied blocks, commit
+};
+
+// A block in the checkpoint table.
+struct ckpt {
+  int blockno;
+  struct buf *pinned;  // the block in the cache
+  struct buf *copy;    // its latest committed contents
+};
+
+// A block that recovery writes home.
+struct replay {
+  int blockno;
+  int pos;       // position in the log of its latest committed copy
+  uint escaped;  // the copy's first word, if zeroed
+};
+
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // blocks in the circular part of the log
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks reserved by them.
+  int want;        // most blocks a waiting begin_opn() needs.
+  int committing;  // copying blocks aside, please wait.
+  char writer;     // log writer sleeps on &log.writer.
+  int force;       // log_sync() wants the transaction committed now.
+  uint opened;     // ticks when the transaction logged its first block.
+  uint seq;        // number of the open transaction.
+  uint committed;  // number of the last committed transaction.
+  int crash;       // log_crash() is waiting.
+  int replayed;    // transactions replayed by the last crash().
   int dev;
   struct logheader lh;
+
+  // used only by the log writer.
+  int head;        // position of the next transaction
+  int used;        // blocks from the header's position to head
+  uint ckpted;     // ticks at the last checkpoint
+  int nckpt;
+  struct ckpt ckpt[NCKPT];
+  struct trans trans;
+
+  // used only by recovery.
+  struct replay replay[NCKPT];
 };
 struct log log;
 
-static void recover_from_log(void);
-static void commit();
+static int recover_from_log(void);
+static void logwriter(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
+  if (sizeof(struct logdesc) >= BSIZE)
+    panic("initlog: too big logdesc");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
-  log.size = sb->nlog;
+  log.size = sb->nlog - 1;
   log.dev = dev;
+  if (log.size < LOGSIZE+2)
+    panic("initlog: log too small");
   recover_from_log();
+  kthread("logwriter", logwriter);
 }
 
-// Copy committed blocks from log to their home location
-static void
-install_trans(int recovering)
-{
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
-  }
+// Block number of position pos in the circular part of the log.
+static int
+logblock(int pos)
+{
+  return log.start + 1 + pos % log.size;
 }
 
-// Read the log header from disk into the in-memory log header
-static void
-read_head(void)
+// Read the descriptor or commit block at position pos into *d.
+// Returns 1 if it belongs to transaction seq, 0 if not.
+static int
+read_desc(int pos, uint magic, uint seq, struct logdesc *d)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
+  struct buf *buf = bread(log.dev, logblock(pos));
+  memmove(d, buf->data, sizeof(*d));
+  buf->valid = 0;  // the log writer writes around the cache
   brelse(buf);
+  return d->magic == magic && d->seq == seq && d->n >= 0 && d->n <= LOGSIZE;
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write the header block: the oldest transaction not
+// yet installed is seq, at position tail.
 static void
-write_head(void)
+write_head(int tail, uint seq)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
-  }
+  struct loghead *hb = (struct loghead *) (buf->data);
+  hb->tail = tail;
+  hb->seq = seq;
   bwrite(buf);
   brelse(buf);
 }
 
+// Copy the first n blocks in log.replay from the log to their
+// home locations. A cached block gets its logged contents in
+// place, with its lock held, so that no reader sees it change
+// back to older contents.
 static void
+replay_blocks(int n)
+{
+  struct buf *dbuf[LOGSIZE];
+  int i, j;
+
+  // queue LOGSIZE writes at a time, so the disk can work on them together.
+  for (i = 0; i < n; i += LOGSIZE) {
+    for (j = 0; j < LOGSIZE && i+j < n; j++) {
+      struct replay *r = &log.replay[i+j];
+      struct buf *lbuf = bread(log.dev, logblock(r->pos)); // read log block
+      dbuf[j] = bread(log.dev, r->blockno); // read dst
+      memmove(dbuf[j]->data, lbuf->data, BSIZE);  // copy block to dst
+      if (r->escaped)
+        *(uint *) (dbuf[j]->data) = r->escaped;
+      bwrite_async(dbuf[j]);  // write dst to disk
+      lbuf->valid = 0;
+      brelse(lbuf);
+    }
+    while (--j >= 0) {
+      bwait(dbuf[j]);
+      brelse(dbuf[j]);
+    }
+  }
+}
+
+// Replay the committed transactions from the header's position
+// on: find the latest copy of each block they hold, then copy
+// those home. Returns the number of transactions replayed.
+static int
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct buf *buf = bread(log.dev, log.start);
+  struct loghead *hb = (struct loghead *) (buf->data);
+  struct logdesc d, c;
+  int pos = hb->tail % log.size;
+  uint seq = hb->seq;
+  int n = 0, nr = 0;
+  int i, j;
+  brelse(buf);
+
+  if (seq == 0)  // never used
+    seq = 1;
+  while (read_desc(pos, LOGDESC, seq, &d) &&
+         read_desc(pos+d.n+1, LOGCOMMIT, seq, &c) && c.n == d.n) {
+    for (i = 0; i < d.n; i++) {
+      for (j = 0; j < nr; j++)
+        if (log.replay[j].blockno == d.block[i])
+          break;
+      if (j == nr) {
+        // the log writer checkpoints before the log holds more
+        // than NCKPT blocks, but don't trust the disk on that.
+        if (nr == NCKPT) {
+          replay_blocks(nr);
+          nr = j = 0;
+        }
+        log.replay[nr++].blockno = d.block[i];
+      }
+      log.replay[j].pos = pos + 1 + i;
+      log.replay[j].escaped = d.escaped[i];
+    }
+    pos = (pos + d.n + 2) % log.size;
+    seq++;
+    n++;
+  }
+  replay_blocks(nr);
+  write_head(pos, seq); // clear the log
+  log.head = pos;
+  log.used = 0;
+  log.ckpted = ticks;
+  log.seq = seq;
+  log.committed = seq - 1;
+  return n;
 }
 
 // called at the start of each FS system call.
 void
 begin_op(void)
 {
+  begin_opn(MAXOPBLOCKS);
+}
+
+// start an FS system call that writes at most n blocks.
+void
+begin_opn(int n)
+{
+  if(n < 1 || n > LOGSIZE)
+    panic("begin_opn");
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.committing || log.force || log.crash){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + log.reserved + n > LOGSIZE){
       // this op might exhaust log space; wait for commit.
+      if(n > log.want)
+        log.want = n;
+      wakeup(&log.writer);
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
       release(&log.lock);
       break;
     }
@@ -142,69 +322,364 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  end_opn(MAXOPBLOCKS);
+}
 
+// end an FS system call started by begin_opn(n).
+// wakes up the log writer if this was the last outstanding
+// operation, but does not wait for the commit.
+void
+end_opn(int n)
+{
   acquire(&log.lock);
   log.outstanding -= 1;
+  log.reserved -= n;
   if(log.committing)
     panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
-  }
+  if(log.outstanding == 0 && log.lh.n > 0)
+    wakeup(&log.writer);
+  // begin_op() may be waiting for log space,
+  // and decrementing log.outstanding has decreased
+  // the amount of reserved space.
+  wakeup(&log);
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// should the log writer commit the open transaction now?
+// caller must hold log.lock.
+static int
+commitnow(void)
+{
+  if(log.lh.n == 0 || log.outstanding > 0)
+    return 0;
+  return log.force || log.crash ||
+         log.lh.n + MAXOPBLOCKS > LOGSIZE ||  // begin_op() may be waiting
+         log.lh.n + log.want > LOGSIZE ||     // begin_opn() is waiting
+         ticks - log.opened >= LOGDELAY;
+}
+
+// is the checkpoint timer up?
+static int
+ckptdue(void)
+{
+  return log.nckpt > 0 && ticks - log.ckpted >= CKPTDELAY;
+}
+
+// may the log writer do what log_crash() asks?
+// caller must hold log.lock.
+static int
+crashnow(void)
+{
+  return log.crash && log.lh.n == 0 && log.outstanding == 0;
+}
+
+// Close the open transaction into t, copying its blocks aside
+// so that FS system calls can start the next one and modify
+// them again. Caller must hold log.lock, and commitnow().
+static void
+snapshot(struct trans *t)
+{
+  int i;
+
+  log.committing = 1;
+  t->seq = log.seq++;
+  t->lh = log.lh;
+  log.lh.n = 0;
+  log.force = 0;
+  log.want = 0;  // waiters find room now, or say so again
+  release(&log.lock);
+
+  for (i = 0; i < t->lh.n; i++) {
+    struct buf *b = bread(log.dev, t->lh.block[i]); // pinned, so cached
+    memmove(t->copy[i+1]->data, b->data, BSIZE);
+    t->pinned[i] = b;
+    brelse(b);
   }
+
+  acquire(&log.lock);
+  log.committing = 0;
+  wakeup(&log);
 }
 
-// Copy modified blocks from cache to log.
+// Queue the writes of t's descriptor and blocks
+// at the head of the log.
 static void
-write_log(void)
+write_log(struct trans *t)
 {
-  int tail;
+  struct logdesc *d = (struct logdesc *) (t->copy[0]->data);
+  int n = t->lh.n;
+  int i;
+
+  t->pos = log.head;
+  log.head = (log.head + n + 2) % log.size;
+  log.used += n + 2;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  d->magic = LOGDESC;
+  d->seq = t->seq;
+  d->n = n;
+  for (i = 0; i < n; i++) {
+    uint *w = (uint *) (t->copy[i+1]->data);
+    d->block[i] = t->lh.block[i];
+    d->escaped[i] = 0;
+    if (*w == LOGDESC || *w == LOGCOMMIT) {
+      d->escaped[i] = *w;
+      *w = 0;
+    }
+  }
+  memmove(t->copy[n+1]->data, d, sizeof(*d));
+  ((struct logdesc *) (t->copy[n+1]->data))->magic = LOGCOMMIT;
+
+  for (i = 0; i < n+2; i++)
+    t->copy[i]->blockno = logblock(t->pos + i);
+  for (i = 0; i < n+1; i++)
+    bwrite_async(t->copy[i]);
+}
+
+// Wait for the log writes of t, then write its commit
+// block. This is the true point at which t commits.
+static void
+commit(struct trans *t)
+{
+  struct logdesc *d = (struct logdesc *) (t->copy[0]->data);
+  int n = t->lh.n;
+
+  for (int i = 0; i < n+1; i++)
+    bwait(t->copy[i]);
+  // the log has the copies; give the escaped ones
+  // their first words back for merge().
+  for (int i = 0; i < n; i++)
+    if (d->escaped[i])
+      *(uint *) (t->copy[i+1]->data) = d->escaped[i];
+  bwrite(t->copy[n+1]);
+
+  acquire(&log.lock);
+  log.committed = t->seq;
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// Enter the committed transaction t's blocks in the
+// checkpoint table. The table keeps one pin on each block.
+static void
+merge(struct trans *t)
+{
+  struct ckpt *e;
+  int i, j;
+
+  for (i = 0; i < t->lh.n; i++) {
+    for (j = 0; j < log.nckpt; j++)
+      if (log.ckpt[j].blockno == t->lh.block[i])
+        break;
+    e = &log.ckpt[j];
+    if (j == log.nckpt) {
+      log.nckpt++;
+      e->blockno = t->lh.block[i];
+      e->pinned = t->pinned[i];
+    } else {
+      bunpin(t->pinned[i]);  // already pinned by the table
+    }
+    memmove(e->copy->data, t->copy[i+1]->data, BSIZE);
   }
 }
 
+// Queue the writes of the blocks in the
+// checkpoint table to their home locations.
 static void
-commit()
-{
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+checkpoint(void)
+{
+  for (int i = 0; i < log.nckpt; i++) {
+    log.ckpt[i].copy->blockno = log.ckpt[i].blockno;
+    bwrite_async(log.ckpt[i].copy);
+  }
+}
+
+// Wait for the writes of checkpoint(), empty the table, and
+// erase the transactions it held from the log: the oldest one
+// left is seq, at position tail.
+static void
+checkpoint_done(int tail, uint seq)
+{
+  for (int i = 0; i < log.nckpt; i++)
+    bwait(log.ckpt[i].copy);
+  write_head(tail, seq);
+  // unpin only now that recovery won't replay the blocks, since
+  // writei() writes a new block that isn't pinned straight home.
+  for (int i = 0; i < log.nckpt; i++)
+    bunpin(log.ckpt[i].pinned);
+  log.nckpt = 0;
+  log.used = (log.head - tail + log.size) % log.size;
+  log.ckpted = ticks;
+}
+
+// Recover from the log as if the system had crashed, and throw
+// away the checkpoint table. Recovery writes the logged contents
+// over the pinned blocks rather than forgetting them first, since
+// FS reads outside a transaction (ilock() from fstat()) don't wait
+// for the crash and must not load a stale home block meanwhile.
+// Returns the number of transactions replayed.
+static int
+crash(void)
+{
+  int n = recover_from_log();
+
+  for (int i = 0; i < log.nckpt; i++)
+    bunpin(log.ckpt[i].pinned);
+  log.nckpt = 0;
+  return n;
+}
+
+// the log writer kernel thread.
+static void
+logwriter(void)
+{
+  struct trans *t = &log.trans;
+  int n, ckpt;
+
+  for (int i = 0; i < LOGSIZE+2; i++)
+    if ((t->copy[i] = bshadow(log.dev)) == 0)
+      panic("logwriter: shadow");
+  for (int i = 0; i < NCKPT; i++)
+    if ((log.ckpt[i].copy = bshadow(log.dev)) == 0)
+      panic("logwriter: shadow");
+
+  acquire(&log.lock);
+  for(;;){
+    while(!commitnow() && !ckptdue() && !crashnow())
+      sleep(&log.writer, &log.lock);
+    if(crashnow()){
+      log.committing = 1;
+      release(&log.lock);
+      n = crash();
+      acquire(&log.lock);
+      log.committing = 0;
+      log.crash = 0;
+      log.replayed = n;
+      wakeup(&log);
+      continue;
+    }
+    n = 0;
+    if(commitnow()){
+      snapshot(t);
+      n = t->lh.n;
+    }
+    ckpt = ckptdue();
+    release(&log.lock);
+
+    // call these w/o holding locks, since not allowed
+    // to sleep with locks.
+    if(n > 0 && (log.used + n + 2 > log.size || log.nckpt + n > NCKPT)){
+      // no room for t until the log is checkpointed.
+      checkpoint();
+      bkick();
+      checkpoint_done(log.head, t->seq);
+      ckpt = 0;
+    } else if(ckpt){
+      checkpoint();  // goes to the disk along with t
+    }
+    if(n > 0)
+      write_log(t);
+    bkick();
+    if(n > 0)
+      commit(t);
+    if(ckpt){
+      if(n > 0)
+        checkpoint_done(t->pos, t->seq);
+      else
+        checkpoint_done(log.head, log.committed + 1);
+    }
+    if(n > 0)
+      merge(t);
+
+    acquire(&log.lock);
+  }
+}
+
+// called by clockintr() on every tick, so that the log writer
+// notices when the open transaction has been open LOGDELAY ticks,
+// or when it is time for a checkpoint.
+void
+logtick(void)
+{
+  if((log.lh.n > 0 && log.outstanding == 0 && !log.committing) ||
+     ckptdue())
+    wakeup(&log.writer);
+}
+
+// wait until the updates of every FS system call that has
+// returned are on disk.
+void
+log_sync(void)
+{
+  uint want;
+
+  acquire(&log.lock);
+  if(log.lh.n > 0){
+    want = log.seq;
+    log.force = 1;
+    wakeup(&log.writer);
+  } else {
+    want = log.seq - 1;  // may still be on its way to the log
   }
+  while(log.committed < want)
+    sleep(&log, &log.lock);
+  release(&log.lock);
 }
 
+// the number of the transaction that the caller's FS
+// system call belongs to.
+uint
+log_opseq(void)
+{
+  uint seq;
+
+  acquire(&log.lock);
+  seq = log.seq;
+  release(&log.lock);
+  return seq;
+}
+
+// has transaction seq committed?
+int
+log_committed(uint seq)
+{
+  int r;
+
+  acquire(&log.lock);
+  r = seq <= log.committed;
+  release(&log.lock);
+  return r;
+}
+
+#ifdef FSCRASH
+// Simulate a crash, for testing: commit the open transaction,
+// then recover the blocks that the log has not yet checkpointed
+// from the log, as if their home locations had never been
+// written. Returns the number of transactions that recovery
+// replayed.
+int
+log_crash(void)
+{
+  int n;
+
+  acquire(&log.lock);
+  while(log.crash)
+    sleep(&log, &log.lock);
+  log.crash = 1;
+  wakeup(&log.writer);
+  while(log.crash)
+    sleep(&log, &log.lock);
+  n = log.replayed;
+  release(&log.lock);
+  return n;
+}
+#endif
+
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// The log writer will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -217,7 +692,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= LOGSIZE)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -229,8 +704,9 @@ log_write(struct buf *b)
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
+    if(log.lh.n == 0)
+      log.opened = ticks;
     log.lh.n++;
   }
   release(&log.lock);
 }
-
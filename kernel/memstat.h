@@ -0,0 +1,10 @@
+// Memory statistics, returned by the memstat() system call.
+struct memstat {
+  uint64 sz;         // size of the process's address space (bytes)
+  uint64 rss;        // user pages resident in memory
+  uint64 shared;     // of those, pages shared copy-on-write
+  uint64 freepages;  // free physical pages
+  uint64 totalpages; // physical pages managed by kalloc()
+  uint64 reclaimed;  // pages given back by shrinkers since boot
+  uint64 oomkills;   // processes killed for lack of memory since boot
+};
@@ -1,13 +1,19 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NVMA         16  // mmap() regions per process
+#define NINODE       50  // minimum size of the i-node cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define MAXIOV       16  // max buffers per readv() or writev()
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in a transaction
+#define LOGBLOCKS    (4*(LOGSIZE+2)+1)  // size of on-disk log
+#define NBUF         (MAXOPBLOCKS*3)  // minimum size of disk block cache
+#define FSSIZE       (2000*(BSIZE/1024))  // default size of file system in blocks (mkfs -s)
+#define NREADAHEAD   8     // blocks to read ahead of sequential reads
+#define LOGDELAY     2     // ticks a transaction stays open for more ops
+#define CKPTDELAY    30    // ticks between checkpoints of the log
 #define MAXPATH      128   // maximum file path name
+#define MAXORDER       9   // largest kalloc_order() block is 2^MAXORDER pages
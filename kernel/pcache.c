@@ -0,0 +1,329 @@
+// File page cache.
+//
+// The page cache holds the data of regular files in whole pages,
+// indexed by inode and page number, so that readi() copies out a
+// page at a time and bulk reads leave the buffer cache to metadata
+// (directories, inodes, bitmap and indirect blocks). A missing page
+// is read with readpages(), which takes blocks that are in the
+// buffer cache from there and reads the rest from the disk straight
+// into the page.
+//
+// Writes still go through the buffer cache and the log; writei()
+// copies what it writes into the cached page as well, and itrunc()
+// drops a file's pages. Both happen with the inode locked, as does
+// every read, so the pages of a file change only under its lock.
+//
+// The cache holds one reference to each page (see kdup() in
+// kalloc.c), pcache_read() takes another while it copies, and
+// mmap() one for each mapping. Only pages with no other reference
+// are recycled or dropped by pcache_shrink(), called by kalloc()
+// when memory runs low, so that a mapped page stays the file's
+// page, seen by read() and write(). Pages are kfree()d with
+// pcache.lock held, which is safe since kalloc() runs the
+// shrinkers without holding kmem.lock.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define NPHASH 1021  // prime, so that pages spread out
+
+// pages to fill at once when a file is read sequentially.
+#define NRAPAGE ((NREADAHEAD * BSIZE + PGSIZE - 1) / PGSIZE)
+
+struct cpage {
+  uint dev;
+  uint inum;
+  uint pgno;             // page number within the file
+  char *pa;              // the data
+  struct cpage *hnext;   // hash chain
+  struct cpage *lnext;   // LRU list
+  struct cpage *lprev;
+};
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache *cache;
+  int n;                        // pages cached
+  int max;                      // limit on n
+  struct cpage *hash[NPHASH];
+  struct cpage lru;             // most recently used first
+} pcache;
+
+static uint64 pcache_shrink(uint64);
+
+void
+pcacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  pcache.cache = kmem_cache_create("cpage", sizeof(struct cpage));
+  pcache.lru.lnext = &pcache.lru;
+  pcache.lru.lprev = &pcache.lru;
+
+  // let the cache grow to a quarter of free memory; the
+  // shrinker gives pages back when others need them.
+  pcache.max = kfreepages() / 4;
+
+  kshrinker(pcache_shrink);
+}
+
+static int
+phash(uint dev, uint inum, uint pgno)
+{
+  return ((dev * 31 + inum) * 31 + pgno) % NPHASH;
+}
+
+static void
+lru_remove(struct cpage *p)
+{
+  p->lprev->lnext = p->lnext;
+  p->lnext->lprev = p->lprev;
+}
+
+static void
+lru_push(struct cpage *p)
+{
+  p->lnext = pcache.lru.lnext;
+  p->lprev = &pcache.lru;
+  pcache.lru.lnext->lprev = p;
+  pcache.lru.lnext = p;
+}
+
+// Find page pgno of ip, moving it to the front of the
+// LRU list. Caller must hold pcache.lock.
+static struct cpage*
+pfind(struct inode *ip, uint pgno)
+{
+  struct cpage *p;
+
+  for(p = pcache.hash[phash(ip->dev, ip->inum, pgno)]; p; p = p->hnext){
+    if(p->dev == ip->dev && p->inum == ip->inum && p->pgno == pgno){
+      lru_remove(p);
+      lru_push(p);
+      return p;
+    }
+  }
+  return 0;
+}
+
+// Remove p from the cache and drop the cache's reference to its
+// page. Returns 1 if that freed the page, 0 if someone else still
+// holds a reference. Caller must hold pcache.lock.
+static int
+premove(struct cpage *p)
+{
+  struct cpage **pp;
+  int last = krefcnt(p->pa) == 1;
+
+  for(pp = &pcache.hash[phash(p->dev, p->inum, p->pgno)]; *pp != p; pp = &(*pp)->hnext)
+    ;
+  *pp = p->hnext;
+  lru_remove(p);
+  kfree(p->pa);
+  kmem_cache_free(pcache.cache, p);
+  pcache.n--;
+  return last;
+}
+
+// Return the least recently used page that only the cache
+// holds, or 0 if there is none. Caller must hold pcache.lock.
+static struct cpage*
+pvictim(void)
+{
+  struct cpage *p;
+
+  for(p = pcache.lru.lprev; p != &pcache.lru; p = p->lprev)
+    if(krefcnt(p->pa) == 1)
+      return p;
+  return 0;
+}
+
+// Add page pa as page pgno of ip, recycling the least recently
+// used page that isn't in use if the cache is full. Returns 0 if
+// there is no memory for the cpage. Caller must hold pcache.lock.
+static int
+pinsert(struct inode *ip, uint pgno, char *pa)
+{
+  struct cpage *p;
+  int h;
+
+  if(pcache.n >= pcache.max && (p = pvictim()) != 0)
+    premove(p);
+  if((p = kmem_cache_alloc(pcache.cache)) == 0)
+    return 0;
+  p->dev = ip->dev;
+  p->inum = ip->inum;
+  p->pgno = pgno;
+  p->pa = pa;
+  h = phash(p->dev, p->inum, p->pgno);
+  p->hnext = pcache.hash[h];
+  pcache.hash[h] = p;
+  lru_push(p);
+  pcache.n++;
+  return 1;
+}
+
+// Return page pgno of file ip with a reference for the caller,
+// who must kfree() it when done, reading it (and, if seq is set,
+// up to NRAPAGE-1 pages after it that aren't cached yet) if it
+// isn't cached. Returns 0 if there is no memory for it.
+// Caller must hold ip->lock.
+static char*
+pget(struct inode *ip, uint pgno, int seq)
+{
+  struct cpage *p;
+  char *pa[NRAPAGE];
+  uint npg;
+  int n, i, ok;
+
+  acquire(&pcache.lock);
+  if((p = pfind(ip, pgno)) != 0){
+    kdup(p->pa);
+    release(&pcache.lock);
+    return p->pa;
+  }
+  release(&pcache.lock);
+
+  // the file's pages change only under ip->lock, so no one
+  // else can add these pages while they are being read.
+  npg = (ip->size + PGSIZE - 1) / PGSIZE;
+  for(n = 0; n < (seq ? NRAPAGE : 1) && pgno + n < npg; n++){
+    if(n > 0){
+      acquire(&pcache.lock);
+      p = pfind(ip, pgno + n);
+      release(&pcache.lock);
+      if(p)
+        break;
+    }
+    if((pa[n] = kalloc()) == 0)
+      break;
+  }
+  if(n == 0)
+    return 0;
+  readpages(ip, pgno, pa, n);
+
+  // the cache takes kalloc()'s reference; the caller gets
+  // another to page pgno, or kalloc()'s if it isn't cached.
+  for(i = 0; i < n; i++){
+    acquire(&pcache.lock);
+    ok = pinsert(ip, pgno + i, pa[i]);
+    release(&pcache.lock);
+    if(ok && i == 0)
+      kdup(pa[0]);
+    else if(!ok && i > 0)
+      kfree(pa[i]);
+  }
+  return pa[0];
+}
+
+// Return page pgno of file ip, which must be within the file,
+// with a reference for the caller, who must kfree() it when done
+// (for a page that vmfault() maps, when it is unmapped). Reads
+// ahead if reads of ip look sequential. Returns 0 if there is no
+// memory.
+// Caller must hold ip->lock.
+char*
+pcache_get(struct inode *ip, uint pgno)
+{
+  int seq;
+
+  // ip->ranext is in pages for a file.
+  seq = pgno == 0 || pgno == ip->ranext || pgno + 1 == ip->ranext;
+  ip->ranext = pgno + 1;
+  return pget(ip, pgno, seq);
+}
+
+// Copy n bytes at offset off of file ip, which must be within the
+// file, to dst, a user virtual address if user_dst is 1 and a kernel
+// address otherwise. Returns the number of bytes copied, which is
+// short only if there is no memory for pages, or -1 if dst is bad.
+// Caller must hold ip->lock.
+int
+pcache_read(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  uint tot, m;
+  char *pa;
+
+  for(tot = 0; tot < n; tot += m, off += m, dst += m){
+    if((pa = pcache_get(ip, off / PGSIZE)) == 0)
+      break;
+    m = min(n - tot, PGSIZE - off % PGSIZE);
+    if(either_copyout(user_dst, dst, pa + off % PGSIZE, m) == -1){
+      kfree(pa);
+      return -1;
+    }
+    kfree(pa);
+  }
+  return tot;
+}
+
+// writei() has written n bytes from src at offset off of file ip,
+// all within one block; copy them into the cached page, if any.
+// Caller must hold ip->lock.
+void
+pcache_write(struct inode *ip, uint off, uchar *src, uint n)
+{
+  struct cpage *p;
+
+  acquire(&pcache.lock);
+  if((p = pfind(ip, off / PGSIZE)) != 0)
+    memmove(p->pa + off % PGSIZE, src, n);
+  release(&pcache.lock);
+}
+
+// Drop the cached pages of file ip, which is being truncated
+// to size bytes, from the one holding offset size on. Looks up
+// each such page, or scans the whole cache if that is smaller.
+// Caller must hold ip->lock; ip->size is still the old size.
+void
+pcache_trunc(struct inode *ip, uint size)
+{
+  struct cpage *p, *next;
+  uint first = size / PGSIZE;
+  uint npg = (ip->size + PGSIZE - 1) / PGSIZE;
+
+  acquire(&pcache.lock);
+  if(npg - first <= pcache.n){
+    for(uint pgno = first; pgno < npg; pgno++)
+      if((p = pfind(ip, pgno)) != 0)
+        premove(p);
+  } else {
+    for(p = pcache.lru.lnext; p != &pcache.lru; p = next){
+      next = p->lnext;
+      if(p->dev == ip->dev && p->inum == ip->inum && p->pgno >= first)
+        premove(p);
+    }
+  }
+  release(&pcache.lock);
+}
+
+// Shrinker, called by kalloc() when memory is low: drop about
+// n of the least recently used pages that aren't in use.
+static uint64
+pcache_shrink(uint64 n)
+{
+  struct cpage *p, *prev;
+  uint64 nfree = 0;
+
+  push_off();
+  int busy = holding(&pcache.lock);  // e.g. pinsert() is allocating
+  pop_off();
+  if(busy)
+    return 0;
+
+  acquire(&pcache.lock);
+  for(p = pcache.lru.lprev; p != &pcache.lru && nfree < n; p = prev){
+    prev = p->lprev;
+    if(krefcnt(p->pa) == 1)
+      nfree += premove(p);
+  }
+  release(&pcache.lock);
+  return nfree;
+}
@@ -7,6 +7,7 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "uio.h"
 
 #define PIPESIZE 512
 
@@ -19,6 +20,14 @@ struct pipe {
   int writeopen;  // write fd is still open
 };
 
+struct kmem_cache *pipecache;
+
+void
+pipeinit(void)
+{
+  pipecache = kmem_cache_create("pipe", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,7 +37,7 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = (struct pipe*)kmem_cache_alloc(pipecache)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
@@ -47,7 +56,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kmem_cache_free(pipecache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,19 +77,27 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    kmem_cache_free(pipecache, pi);
   } else
     release(&pi->lock);
 }
 
+// Write the n buffers described by iov to pipe pi, waiting
+// for the reader to make room as needed. Returns the number of
+// bytes written, or -1 if the reader has gone away.
 int
-pipewrite(struct pipe *pi, uint64 addr, int n)
+pipewrite(struct pipe *pi, struct iovec *iov, int n)
 {
-  int i = 0;
+  int i = 0, k = 0, tot = 0;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
-  while(i < n){
+  while(k < n){
+    if(i >= iov[k].iov_len){
+      k++;
+      i = 0;
+      continue;
+    }
     if(pi->readopen == 0 || killed(pr)){
       release(&pi->lock);
       return -1;
@@ -90,22 +107,27 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       sleep(&pi->nwrite, &pi->lock);
     } else {
       char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      if(copyin(pr->pagetable, &ch, (uint64)iov[k].iov_base + i, 1) == -1)
         break;
       pi->data[pi->nwrite++ % PIPESIZE] = ch;
       i++;
+      tot++;
     }
   }
   wakeup(&pi->nread);
   release(&pi->lock);
 
-  return i;
+  return tot;
 }
 
+// Read from pipe pi into the n buffers described by iov,
+// filling each before moving to the next. Waits until there is
+// something to read, then takes what is there without waiting
+// again. Returns the number of bytes read.
 int
-piperead(struct pipe *pi, uint64 addr, int n)
+piperead(struct pipe *pi, struct iovec *iov, int n)
 {
-  int i;
+  int i, k, tot = 0;
   struct proc *pr = myproc();
   char ch;
 
@@ -117,14 +139,18 @@ piperead(struct pipe *pi, uint64 addr, int n)
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
-      break;
+  for(k = 0; k < n; k++){
+    for(i = 0; i < iov[k].iov_len; i++){  //DOC: piperead-copy
+      if(pi->nread == pi->nwrite)
+        goto done;
+      ch = pi->data[pi->nread++ % PIPESIZE];
+      if(copyout(pr->pagetable, (uint64)iov[k].iov_base + i, &ch, 1) == -1)
+        goto done;
+      tot++;
+    }
   }
+done:
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
-  return i;
+  return tot;
 }
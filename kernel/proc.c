@@ -5,6 +5,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "memstat.h"
 
 struct cpu cpus[NCPU];
 
@@ -26,6 +27,8 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
+uint64 oomkills;  // processes killed by oomkill()
+
 // Allocate a page for each process's kernel stack.
 // Map it high in memory, followed by an invalid
 // guard page.
@@ -162,6 +165,7 @@ freeproc(struct proc *p)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
   p->sz = 0;
+  p->kfn = 0;
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
@@ -255,6 +259,8 @@ userinit(void)
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only reserves the address range; vmfault()
+// allocates each page when it is first touched.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -264,9 +270,9 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if(sz + n > vmabase(p))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
@@ -295,6 +301,11 @@ fork(void)
     return -1;
   }
   np->sz = p->sz;
+  if(mmapcopy(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -351,6 +362,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Unmap mmap() regions, writing back dirty shared pages.
+  munmapall(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -530,6 +544,34 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  myproc()->kfn();
+  panic("kthread returned");
+}
+
+// Start a kernel thread, a process that runs fn() in the kernel
+// and never returns to user space. fn must not return.
+void
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
@@ -622,6 +664,45 @@ killed(struct proc *p)
   return k;
 }
 
+// Kill p because a page it touched could not be allocated,
+// even after kalloc() ran the shrinkers.
+void
+oomkill(struct proc *p)
+{
+  printf("oomkill: out of memory, killing pid %d (%s)\n", p->pid, p->name);
+  __sync_fetch_and_add(&oomkills, 1);
+  setkilled(p);
+}
+
+// Fill in *st for the process with the given pid,
+// or for the calling process if pid is 0.
+// Returns 0 on success, -1 if there is no such process.
+int
+procmemstat(int pid, struct memstat *st)
+{
+  struct proc *p;
+
+  if(pid == 0)
+    pid = myproc()->pid;
+  memset(st, 0, sizeof(*st));
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      // p->lock keeps exec() and wait() from freeing
+      // the page table while it's being walked.
+      st->sz = p->sz;
+      if(p->pagetable)
+        uvmstat(p->pagetable, &st->rss, &st->shared);
+      release(&p->lock);
+      st->oomkills = oomkills;
+      kmemstat(st);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
 // Copy to either a user address, or kernel address,
 // depending on usr_dst.
 // Returns 0 on success, -1 on error.
@@ -81,6 +81,17 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A region of user memory created by mmap(). vmfault() maps
+// its pages when they are first touched.
+struct vma {
+  uint64 addr;                 // first address, page-aligned; 0 if unused
+  uint64 len;                  // bytes, a multiple of PGSIZE
+  int prot;                    // PROT_READ etc.
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;              // mapped file, or 0 if anonymous
+  uint off;                    // offset in f of addr
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -103,5 +114,7 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // mmap() regions
   char name[16];               // Process name (debugging)
+  void (*kfn)(void);           // kernel thread's function, see kthread()
 };
@@ -0,0 +1,281 @@
+// Slab allocator for small, fixed-size kernel objects.
+//
+// A kmem_cache hands out objects of a single size. It carves
+// them out of slabs, each a block of 2^order pages obtained from
+// kalloc_order(). A slab begins with a struct slab header that
+// links it into its cache and keeps a free list of its objects.
+// Since buddy blocks are aligned to their size, the header of the
+// slab holding an object is found by rounding the object's address
+// down to the slab size.
+//
+// Each CPU keeps a small magazine of free objects per cache, so
+// that most allocations and frees only need push_off() instead of
+// the cache's lock. Magazines are refilled from, and flushed to,
+// the slabs in batches of MAGSIZE/2 objects. When memory runs low,
+// kalloc() calls slab_shrink() to empty the magazines.
+//
+// Interface:
+// * c = kmem_cache_create("name", sizeof(struct foo)) at boot.
+// * p = kmem_cache_alloc(c) returns an uninitialized object, or 0.
+// * kmem_cache_free(c, p) returns it to the cache.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NKCACHE  16  // maximum number of caches
+#define MAGSIZE  16  // objects in each per-CPU magazine
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;  // on the cache's partial or full list
+  struct slab *prev;
+  void *free;         // free objects, linked through their first word
+  int inuse;          // number of allocated objects
+};
+
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;
+  uint size;          // object size, a multiple of 8 bytes
+  int order;          // each slab is 2^order pages
+  int perslab;        // objects per slab
+  struct slab partial; // slabs with at least one free object
+  struct slab full;    // slabs with no free objects
+  int nslab;
+
+  // per-CPU magazines of free objects.
+  // mag[i] may only be touched by CPU i with interrupts off.
+  struct {
+    int n;
+    void *obj[MAGSIZE];
+  } mag[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  int n;
+  struct kmem_cache cache[NKCACHE];
+} slabs;
+
+#define HDRSIZE ((sizeof(struct slab) + 7) & ~7L)
+
+static uint64 slab_shrink(uint64);
+
+void
+slabinit(void)
+{
+  initlock(&slabs.lock, "slabs");
+  // the first shrinker, which kreclaim() always runs last.
+  kshrinker(slab_shrink);
+}
+
+static void
+list_init(struct slab *h)
+{
+  h->next = h;
+  h->prev = h;
+}
+
+static void
+list_remove(struct slab *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+}
+
+static void
+list_push(struct slab *h, struct slab *s)
+{
+  s->next = h->next;
+  s->prev = h;
+  h->next->prev = s;
+  h->next = s;
+}
+
+// Create a cache of objects of the given size.
+// Panics if there are too many caches or the objects are too big.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+  int order;
+
+  size = (size + 7) & ~7;
+  if(size == 0 || HDRSIZE + size > (PGSIZE << MAXORDER))
+    panic("kmem_cache_create: size");
+
+  // use the smallest slab that holds a few objects.
+  for(order = 0; order < MAXORDER; order++)
+    if(((PGSIZE << order) - HDRSIZE) / size >= 8)
+      break;
+
+  acquire(&slabs.lock);
+  if(slabs.n >= NKCACHE)
+    panic("kmem_cache_create: too many caches");
+  c = &slabs.cache[slabs.n++];
+  release(&slabs.lock);
+
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->order = order;
+  c->perslab = ((PGSIZE << order) - HDRSIZE) / size;
+  list_init(&c->partial);
+  list_init(&c->full);
+  c->nslab = 0;
+  for(int i = 0; i < NCPU; i++)
+    c->mag[i].n = 0;
+  return c;
+}
+
+// Allocate and carve up a new slab for c.
+// Caller must hold c->lock.
+static struct slab*
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *p;
+
+  if((s = (struct slab*)kalloc_order(c->order)) == 0)
+    return 0;
+  s->cache = c;
+  s->inuse = 0;
+  s->free = 0;
+  p = (char*)s + HDRSIZE + (c->perslab - 1) * c->size;
+  for(; p >= (char*)s + HDRSIZE; p -= c->size){
+    *(void**)p = s->free;
+    s->free = p;
+  }
+  list_push(&c->partial, s);
+  c->nslab++;
+  return s;
+}
+
+// Take one object from c's slabs.
+// Caller must hold c->lock.
+static void*
+slab_get(struct kmem_cache *c)
+{
+  struct slab *s;
+  void *obj;
+
+  s = c->partial.next;
+  if(s == &c->partial && (s = slab_grow(c)) == 0)
+    return 0;
+  obj = s->free;
+  s->free = *(void**)obj;
+  s->inuse++;
+  if(s->free == 0){
+    list_remove(s);
+    list_push(&c->full, s);
+  }
+  return obj;
+}
+
+// Return one object to its slab, freeing the slab
+// if it becomes empty. Returns the number of pages freed.
+// Caller must hold c->lock.
+static int
+slab_put(struct kmem_cache *c, void *obj)
+{
+  struct slab *s;
+
+  s = (struct slab*)((uint64)obj & ~((uint64)(PGSIZE << c->order) - 1));
+  if(s->cache != c)
+    panic("kmem_cache_free: wrong cache");
+  if(s->free == 0){
+    list_remove(s);
+    list_push(&c->partial, s);
+  }
+  *(void**)obj = s->free;
+  s->free = obj;
+  if(--s->inuse == 0){
+    list_remove(s);
+    c->nslab--;
+    kfree((void*)s);
+    return 1 << c->order;
+  }
+  return 0;
+}
+
+// Allocate an object from cache c.
+// Returns 0 if memory cannot be allocated.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  void *obj;
+
+  push_off();
+  int id = cpuid();
+  if(c->mag[id].n > 0){
+    obj = c->mag[id].obj[--c->mag[id].n];
+    pop_off();
+    return obj;
+  }
+  pop_off();
+
+  acquire(&c->lock);
+  // acquire() turned interrupts off, so this
+  // CPU's magazine is stable until release().
+  id = cpuid();
+  obj = slab_get(c);
+  while(obj && c->mag[id].n < MAGSIZE/2){
+    void *extra = slab_get(c);
+    if(extra == 0)
+      break;
+    c->mag[id].obj[c->mag[id].n++] = extra;
+  }
+  release(&c->lock);
+  return obj;
+}
+
+// Free an object that was allocated from cache c.
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  push_off();
+  int id = cpuid();
+  if(c->mag[id].n < MAGSIZE){
+    c->mag[id].obj[c->mag[id].n++] = obj;
+    pop_off();
+    return;
+  }
+  pop_off();
+
+  acquire(&c->lock);
+  id = cpuid();
+  while(c->mag[id].n > MAGSIZE/2)
+    slab_put(c, c->mag[id].obj[--c->mag[id].n]);
+  slab_put(c, obj);
+  release(&c->lock);
+}
+
+// Shrinker, called by kalloc() when memory is low: return the
+// objects in this CPU's magazines to their slabs, freeing slabs
+// that become empty. Other CPUs' magazines are left alone, since
+// only their owners may touch them.
+static uint64
+slab_shrink(uint64 n)
+{
+  struct kmem_cache *c;
+  uint64 freed = 0;
+
+  for(int i = 0; i < slabs.n && freed < n; i++){
+    c = &slabs.cache[i];
+    push_off();
+    int busy = holding(&c->lock);  // e.g. slab_grow() is allocating
+    pop_off();
+    if(busy)
+      continue;
+    acquire(&c->lock);
+    int id = cpuid();
+    while(c->mag[id].n > 0)
+      freed += slab_put(c, c->mag[id].obj[--c->mag[id].n]);
+    release(&c->lock);
+  }
+  return freed;
+}
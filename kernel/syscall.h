@@ -20,3 +20,12 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_memstat 22
+#define SYS_fsync  23
+#define SYS_fscrash 24
+#define SYS_mmap   25
+#define SYS_munmap 26
+#define SYS_readv  27
+#define SYS_writev 28
+#define SYS_pread  29
+#define SYS_pwrite 30
@@ -8,6 +8,7 @@
 #include "riscv.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
 #include "stat.h"
 #include "spinlock.h"
 #include "proc.h"
@@ -15,6 +16,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "uio.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -94,6 +96,95 @@ sys_write(void)
   return filewrite(f, p, n);
 }
 
+// Fetch the buffers of a readv() or writev() call: the nth
+// argument points to an array of iovecs, and the next is
+// their number. Returns the number of buffers, or -1 if the
+// array or a length is bad.
+static int
+argiov(int n, struct iovec *iov)
+{
+  uint64 uiov;
+  int cnt, tot = 0;
+
+  argaddr(n, &uiov);
+  argint(n+1, &cnt);
+  if(cnt < 0 || cnt > MAXIOV)
+    return -1;
+  if(copyin(myproc()->pagetable, (char*)iov, uiov, cnt * sizeof(struct iovec)) < 0)
+    return -1;
+  for(int i = 0; i < cnt; i++){
+    // the total is returned as an int.
+    if(iov[i].iov_len < 0 || iov[i].iov_len > 0x7fffffff - tot)
+      return -1;
+    tot += iov[i].iov_len;
+  }
+  return cnt;
+}
+
+uint64
+sys_readv(void)
+{
+  struct file *f;
+  struct iovec iov[MAXIOV];
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || (n = argiov(1, iov)) < 0)
+    return -1;
+  return filereadv(f, iov, n, -1);
+}
+
+uint64
+sys_writev(void)
+{
+  struct file *f;
+  struct iovec iov[MAXIOV];
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || (n = argiov(1, iov)) < 0)
+    return -1;
+  return filewritev(f, iov, n, -1);
+}
+
+// Read at a given offset, without using or moving the
+// file's own offset.
+uint64
+sys_pread(void)
+{
+  struct file *f;
+  struct iovec iov;
+  int n, off;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, &off);
+  if(argfd(0, 0, &f) < 0 || n < 0 || off < 0)
+    return -1;
+  iov.iov_base = (void*)p;
+  iov.iov_len = n;
+  return filereadv(f, &iov, 1, off);
+}
+
+// Write at a given offset, without using or moving the
+// file's own offset.
+uint64
+sys_pwrite(void)
+{
+  struct file *f;
+  struct iovec iov;
+  int n, off;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, &off);
+  if(argfd(0, 0, &f) < 0 || n < 0 || off < 0)
+    return -1;
+  iov.iov_base = (void*)p;
+  iov.iov_len = n;
+  return filewritev(f, &iov, 1, off);
+}
+
 uint64
 sys_close(void)
 {
@@ -119,6 +210,25 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filesync(f);
+}
+
+#ifdef FSCRASH
+// Simulate a crash and recovery of the file system, for testing.
+uint64
+sys_fscrash(void)
+{
+  return log_crash();
+}
+#endif
+
 // Create the path new as a link to the same inode as old.
 uint64
 sys_link(void)
@@ -176,10 +286,12 @@ isdirempty(struct inode *dp)
   int off;
   struct dirent de;
 
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
+  // a hashed directory keeps "." and ".." in
+  // its leaves, after the index in block 0.
+  for(off = dirhashed(dp) ? BSIZE : 0; off<dp->size; off+=sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("isdirempty: readi");
-    if(de.inum != 0)
+    if(de.inum != 0 && namecmp(de.name, ".") != 0 && namecmp(de.name, "..") != 0)
       return 0;
   }
   return 1;
@@ -222,6 +334,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcache_enter(dp, name, 0, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -503,3 +616,220 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// Write the page at pa back to offset off of the file mapped by
+// v, up to MAXWRITE bytes per transaction as filewrite() does.
+// Writes only what lies within the file, since a mapping can't
+// extend it.
+static void
+vmawrite(struct vma *v, char *pa, uint off)
+{
+  struct inode *ip = v->f->ip;
+  uint i, n, max;
+
+  for(i = 0; i < PGSIZE; i += max){
+    max = PGSIZE - i;
+    if(max > MAXWRITE)
+      max = MAXWRITE;
+    begin_opn(WRITEOPBLOCKS(max));
+    ilock(ip);
+    if(off + i >= ip->size){
+      iunlock(ip);
+      end_opn(WRITEOPBLOCKS(max));
+      break;
+    }
+    n = max;
+    if(n > ip->size - (off + i))
+      n = ip->size - (off + i);
+    writei(ip, 0, (uint64)pa + i, off + i, n);
+    iunlock(ip);
+    end_opn(WRITEOPBLOCKS(max));
+  }
+}
+
+// Unmap the pages of region v between va and va+len from p,
+// first writing those that are dirty back to the file if v is
+// a writable MAP_SHARED mapping of one.
+static void
+vmaunmap(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  pte_t *pte;
+
+  if(v->f && (v->flags & MAP_SHARED) && (v->prot & PROT_WRITE)){
+    for(uint64 a = va; a < va + len; a += PGSIZE){
+      if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+        continue;
+      if(*pte & PTE_D)
+        vmawrite(v, (char*)PTE2PA(*pte), v->off + (a - v->addr));
+    }
+  }
+  uvmunmap(p->pagetable, va, len / PGSIZE, 1);
+}
+
+// Remove all of p's mmap() regions, writing dirty shared
+// pages back; for exit() and exec().
+void
+munmapall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->addr == 0)
+      continue;
+    vmaunmap(p, v, v->addr, v->len);
+    if(v->f)
+      fileclose(v->f);
+    v->addr = 0;
+  }
+}
+
+// Give the child np of fork() the mmap() regions of p. Pages of
+// MAP_SHARED regions are shared, others copy-on-write. Returns 0,
+// or -1 with np left with no regions if out of memory.
+int
+mmapcopy(struct proc *p, struct proc *np)
+{
+  struct vma *v, *nv;
+  pte_t *pte;
+
+  for(v = p->vma, nv = np->vma; v < &p->vma[NVMA]; v++, nv++){
+    if(v->addr == 0)
+      continue;
+    if(v->f == 0 && (v->flags & MAP_SHARED) && v->prot != PROT_NONE){
+      // fill in the untouched pages of a shared anonymous region
+      // now, or p and np would each get their own on first touch.
+      for(uint64 a = v->addr; a < v->addr + v->len; a += PGSIZE){
+        pte = walk(p->pagetable, a, 0);
+        if((pte == 0 || (*pte & PTE_V) == 0) && vmfault(p->pagetable, a, 0) != 0)
+          goto bad;
+      }
+    }
+    if(uvmcopyrange(p->pagetable, np->pagetable, v->addr, v->len,
+                    (v->flags & MAP_SHARED) == 0) < 0)
+      goto bad;
+    *nv = *v;
+    if(nv->f)
+      filedup(nv->f);
+  }
+  return 0;
+
+ bad:
+  // nothing is dirty that isn't also dirty in p.
+  for(nv = np->vma; nv < &np->vma[NVMA]; nv++){
+    if(nv->addr == 0)
+      continue;
+    uvmunmap(np->pagetable, nv->addr, nv->len / PGSIZE, 1);
+    if(nv->f)
+      fileclose(nv->f);
+    nv->addr = 0;
+  }
+  return -1;
+}
+
+// void *mmap(void *addr, int len, int prot, int flags, int fd, int off)
+// Map len bytes of the file open as fd, starting at offset off,
+// which must be page-aligned, or of zeroed memory if flags has
+// MAP_ANONYMOUS. The kernel chooses the address; addr is ignored.
+// Pages are read in when first touched (see vmfault()).
+uint64
+sys_mmap(void)
+{
+  struct proc *p = myproc();
+  struct vma *v = 0;
+  struct file *f = 0;
+  uint64 addr;
+  int len, prot, flags, off;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(5, &off);
+  if(len <= 0 || off < 0 || off % PGSIZE != 0)
+    return -1;
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  if((flags & MAP_ANONYMOUS) == 0){
+    if(argfd(4, 0, &f) < 0 || f->type != FD_INODE || f->ip->type != T_FILE)
+      return -1;
+    if(!f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  for(int i = 0; i < NVMA; i++){
+    if(p->vma[i].addr == 0){
+      v = &p->vma[i];
+      break;
+    }
+  }
+  if(v == 0)
+    return -1;
+
+  addr = vmabase(p) - PGROUNDUP(len);
+  if(addr < PGROUNDUP(p->sz) || addr >= TRAPFRAME)
+    return -1;
+  v->addr = addr;
+  v->len = PGROUNDUP(len);
+  v->prot = prot;
+  v->flags = flags & (MAP_SHARED|MAP_PRIVATE);
+  v->f = f ? filedup(f) : 0;
+  v->off = off;
+  return addr;
+}
+
+// int munmap(void *addr, int len)
+// Unmap the pages between addr, which must be page-aligned, and
+// addr+len, which must lie within one mmap() region. Dirty pages of
+// a writable MAP_SHARED file mapping are written back to the file.
+uint64
+sys_munmap(void)
+{
+  struct proc *p = myproc();
+  struct vma *v, *nv = 0;
+  uint64 addr, end;
+  int len;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  if(len <= 0 || addr % PGSIZE != 0)
+    return -1;
+  end = addr + PGROUNDUP(len);
+  if((v = vmafind(p, addr)) == 0 || end > v->addr + v->len)
+    return -1;
+
+  if(addr > v->addr && end < v->addr + v->len){
+    // a hole in the middle: the part after it needs a region.
+    for(int i = 0; i < NVMA; i++){
+      if(p->vma[i].addr == 0){
+        nv = &p->vma[i];
+        break;
+      }
+    }
+    if(nv == 0)
+      return -1;
+  }
+
+  vmaunmap(p, v, addr, end - addr);
+  if(nv){
+    *nv = *v;
+    nv->addr = end;
+    nv->len = v->addr + v->len - end;
+    nv->off = v->off + (end - v->addr);
+    if(nv->f)
+      filedup(nv->f);
+    v->len = addr - v->addr;
+  } else if(addr == v->addr && end == v->addr + v->len){
+    if(v->f)
+      fileclose(v->f);
+    v->addr = 0;
+  } else if(addr == v->addr){
+    v->off += end - addr;
+    v->len -= end - addr;
+    v->addr = end;
+  } else {
+    v->len = addr - v->addr;
+  }
+  return 0;
+}
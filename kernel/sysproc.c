@@ -5,6 +5,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "memstat.h"
 
 uint64
 sys_exit(void)
@@ -91,3 +92,20 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+// return memory statistics for a process.
+uint64
+sys_memstat(void)
+{
+  int pid;
+  uint64 addr;
+  struct memstat st;
+
+  argint(0, &pid);
+  argaddr(1, &addr);
+  if(procmemstat(pid, &st) < 0)
+    return -1;
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
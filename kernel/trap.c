@@ -65,6 +65,16 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    // page fault on a lazily allocated, mmap()ed or copy-on-write page.
+    int r = vmfault(p->pagetable, r_stval(), r_scause() == 15);
+    if(r == -2){
+      oomkill(p);
+    } else if(r < 0){
+      printf("usertrap(): page fault pid=%d sepc=%p stval=%p\n",
+             p->pid, r_sepc(), r_stval());
+      setkilled(p);
+    }
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -167,6 +177,7 @@ clockintr()
   ticks++;
   wakeup(&ticks);
   release(&tickslock);
+  logtick();
 }
 
 // check if it's an external interrupt or software interrupt,
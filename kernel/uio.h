@@ -0,0 +1,5 @@
+// A buffer for the readv() and writev() system calls.
+struct iovec {
+  void *iov_base;  // start of the buffer
+  int iov_len;     // its length in bytes
+};
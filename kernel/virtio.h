@@ -29,6 +29,10 @@
 #define VIRTIO_MMIO_DRIVER_DESC_HIGH	0x094
 #define VIRTIO_MMIO_DEVICE_DESC_LOW	0x0a0 // physical address for used ring, write-only
 #define VIRTIO_MMIO_DEVICE_DESC_HIGH	0x0a4
+#define VIRTIO_MMIO_CONFIG		0x100 // device-specific configuration space
+
+// offset of num_queues in the virtio-blk configuration space.
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES	34
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -47,7 +51,22 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+#define NUM 128
+
+// the most blocks the driver merges into one request.
+#define MAXSEG 16
+
+// the most virtqueues the driver uses, one per CPU.
+#define NVQ NCPU
+
+// how long virtio_disk_wait() polls for completion before
+// it sleeps, in units of the time CSR (100ns on qemu).
+#define POLLTIME 200
+
+// with EVENT_IDX, true if moving an index from old to new_idx
+// passed event_idx, so the other side asked to be told.
+#define vring_need_event(event_idx, new_idx, old) \
+  ((uint16)((new_idx) - (event_idx) - 1) < (uint16)((new_idx) - (old)))
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -64,7 +83,7 @@ struct virtq_avail {
   uint16 flags; // always zero
   uint16 idx;   // driver will write ring[idx] next
   uint16 ring[NUM]; // descriptor numbers of chain heads
-  uint16 unused;
+  uint16 used_event; // with EVENT_IDX: interrupt when used idx passes this
 };
 
 // one entry in the "used" ring, with which the
@@ -78,6 +97,7 @@ struct virtq_used {
   uint16 flags; // always zero
   uint16 idx;   // device increments when it adds a ring[] entry
   struct virtq_used_elem ring[NUM];
+  uint16 avail_event; // with EVENT_IDX: notify when avail idx passes this
 };
 
 // these are specific to virtio block devices, e.g. disks,
@@ -19,7 +19,9 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
-static struct disk {
+// one virtqueue. the device may have several, so that
+// CPUs can submit requests without contending for a lock.
+struct vq {
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
   // disk operations. there are NUM descriptors.
@@ -46,25 +48,87 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b;  // bufs of the request, linked through qnext
+    int n;          // number of bufs
+    int last;       // descriptor of the last buf's data
+    char write;
     char status;
+    char async;  // no one waits; virtio_disk_intr() calls bdone()
   } info[NUM];
 
+  // chains built by virtio_disk_submit() that kick() has not
+  // yet put on the avail ring. until then, a chain can grow.
+  uint16 pending[NUM];
+  int npending;
+
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
-  
-  struct spinlock vdisk_lock;
-  
+
+  int id;  // queue number
+  struct spinlock lock;
+};
+
+static struct disk {
+  struct vq q[NVQ];
+  int nq;  // number of queues in use
+  int event_idx;  // VIRTIO_RING_F_EVENT_IDX was negotiated
 } disk;
 
+// set up virtqueue number id.
+static void
+vq_init(struct vq *q, int id)
+{
+  q->id = id;
+  initlock(&q->lock, "virtio_disk");
+
+  *R(VIRTIO_MMIO_QUEUE_SEL) = id;
+
+  // ensure the queue is not in use.
+  if(*R(VIRTIO_MMIO_QUEUE_READY))
+    panic("virtio disk should not be ready");
+
+  // check maximum queue size.
+  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if(max == 0)
+    panic("virtio disk has no queue");
+  if(max < NUM)
+    panic("virtio disk max queue too short");
+
+  // allocate and zero queue memory.
+  q->desc = kalloc();
+  q->avail = kalloc();
+  q->used = kalloc();
+  if(!q->desc || !q->avail || !q->used)
+    panic("virtio disk kalloc");
+  memset(q->desc, 0, PGSIZE);
+  memset(q->avail, 0, PGSIZE);
+  memset(q->used, 0, PGSIZE);
+
+  // set queue size.
+  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+
+  // write physical addresses.
+  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)q->desc;
+  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)q->desc >> 32;
+  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)q->avail;
+  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)q->avail >> 32;
+  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)q->used;
+  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)q->used >> 32;
+
+  // queue is ready.
+  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+
+  // all NUM descriptors start out unused.
+  for(int i = 0; i < NUM; i++)
+    q->free[i] = 1;
+}
+
 void
 virtio_disk_init(void)
 {
   uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
-
   if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
      *R(VIRTIO_MMIO_VERSION) != 2 ||
      *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
@@ -88,11 +152,10 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
   features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.event_idx = (features & (1 << VIRTIO_RING_F_EVENT_IDX)) != 0;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -103,47 +166,18 @@ virtio_disk_init(void)
   if(!(status & VIRTIO_CONFIG_S_FEATURES_OK))
     panic("virtio disk FEATURES_OK unset");
 
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-
-  // ensure queue 0 is not in use.
-  if(*R(VIRTIO_MMIO_QUEUE_READY))
-    panic("virtio disk should not be ready");
-
-  // check maximum queue size.
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
-
-  // allocate and zero queue memory.
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
-  if(!disk.desc || !disk.avail || !disk.used)
-    panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
-
-  // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-
-  // write physical addresses.
-  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
-  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)disk.desc >> 32;
-  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)disk.avail;
-  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk.avail >> 32;
-  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)disk.used;
-  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk.used >> 32;
-
-  // queue is ready.
-  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
-
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  // with VIRTIO_BLK_F_MQ, the device has num_queues queues
+  // (qemu's -device virtio-blk-device,num-queues=N).
+  // use up to one per CPU.
+  disk.nq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ))
+    disk.nq = *(volatile uint16 *)(VIRTIO0 + VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_NUM_QUEUES);
+  if(disk.nq < 1)
+    disk.nq = 1;
+  if(disk.nq > NVQ)
+    disk.nq = NVQ;
+  for(int i = 0; i < disk.nq; i++)
+    vq_init(&disk.q[i], i);
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
@@ -154,11 +188,11 @@ virtio_disk_init(void)
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct vq *q)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+    if(q->free[i]){
+      q->free[i] = 0;
       return i;
     }
   }
@@ -167,28 +201,28 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct vq *q, int i)
 {
   if(i >= NUM)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(q->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  q->desc[i].addr = 0;
+  q->desc[i].len = 0;
+  q->desc[i].flags = 0;
+  q->desc[i].next = 0;
+  q->free[i] = 1;
+  wakeup(&q->free[0]);
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct vq *q, int i)
 {
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = q->desc[i].flags;
+    int nxt = q->desc[i].next;
+    free_desc(q, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -199,43 +233,142 @@ free_chain(int i)
 // allocate three descriptors (they need not be contiguous).
 // disk transfers always use three descriptors.
 static int
-alloc3_desc(int *idx)
+alloc3_desc(struct vq *q, int *idx)
 {
   for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+    idx[i] = alloc_desc(q);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(q, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// put the pending chains on the avail ring and tell the device.
+// caller must hold q->lock.
+static void
+kick(struct vq *q)
+{
+  if(q->npending == 0)
+    return;
+
+  // tell the device the first index in each chain of descriptors.
+  for(int i = 0; i < q->npending; i++)
+    q->avail->ring[(q->avail->idx + i) % NUM] = q->pending[i];
+
+  __sync_synchronize();
+
+  // tell the device more avail ring entries are available.
+  uint16 old = q->avail->idx;
+  q->avail->idx += q->npending; // not % NUM ...
+  q->npending = 0;
+
+  __sync_synchronize();
+
+  // with EVENT_IDX, a device that is still working through
+  // the ring says it doesn't need a notification.
+  if(disk.event_idx &&
+     !vring_need_event(*(volatile uint16*)&q->used->avail_event, q->avail->idx, old))
+    return;
+
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = q->id; // value is queue number
+}
+
+// if b continues the last pending request, on the disk and
+// in kind, add a descriptor for b's data to that request's
+// chain, just before its status descriptor.
+// returns 0 if b was merged.
+// caller must hold q->lock.
+static int
+merge(struct vq *q, struct buf *b, int write, int async)
+{
+  int h, d, last;
+
+  if(q->npending == 0)
+    return -1;
+  h = q->pending[q->npending-1];
+  if(q->info[h].write != write || q->info[h].async != async ||
+     q->info[h].n >= MAXSEG ||
+     q->ops[h].sector + q->info[h].n * (BSIZE / 512) != b->blockno * (BSIZE / 512))
+    return -1;
+  if((d = alloc_desc(q)) < 0)
+    return -1;
+
+  last = q->info[h].last;
+  q->desc[d].addr = (uint64) b->data;
+  q->desc[d].len = BSIZE;
+  q->desc[d].flags = q->desc[last].flags; // same direction, and NEXT
+  q->desc[d].next = q->desc[last].next;   // the status descriptor
+  q->desc[last].next = d;
+  q->info[h].last = d;
+  b->queue = q->id;
+
+  struct buf *t = q->info[h].b;
+  while(t->qnext)
+    t = t->qnext;
+  t->qnext = b;
+  b->qnext = 0;
+  q->info[h].n++;
+  b->disk = 1;
+  return 0;
+}
+
+// queue a disk operation on locked buffer b, but don't tell the
+// device yet; virtio_disk_kick() or virtio_disk_wait() will,
+// so that a batch of requests costs a single notification.
+// a block that follows the previous queued one on the disk joins
+// its request, so that a run of blocks becomes one transfer with
+// a scatter-gather chain of data descriptors.
+//
+// if async is 0, the caller must later call virtio_disk_wait(b).
+// if async is 1 (reads only), no one waits: virtio_disk_intr()
+// hands b to bdone() when the read finishes, and if the queue is
+// full, submit returns -1 instead of sleeping.
+int
+virtio_disk_submit(struct buf *b, int write, int async)
 {
   uint64 sector = b->blockno * (BSIZE / 512);
+  struct vq *q;
 
-  acquire(&disk.vdisk_lock);
+  // use this CPU's queue.
+  push_off();
+  q = &disk.q[cpuid() % disk.nq];
+  pop_off();
+
+  acquire(&q->lock);
+
+  if(merge(q, b, write, async) == 0){
+    release(&q->lock);
+    return 0;
+  }
 
   // the spec's Section 5.2 says that legacy block operations use
   // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // data, one for a 1-byte status result. merge() may add more
+  // data descriptors later.
 
   // allocate the three descriptors.
   int idx[3];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(alloc3_desc(q, idx) == 0) {
       break;
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+    if(async){
+      release(&q->lock);
+      return -1;
+    }
+    // the requests holding descriptors may not have
+    // been sent yet.
+    kick(q);
+    sleep(&q->free[0], &q->lock);
   }
 
   // format the three descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &q->ops[idx[0]];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -244,84 +377,186 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  q->desc[idx[0]].addr = (uint64) buf0;
+  q->desc[idx[0]].len = sizeof(struct virtio_blk_req);
+  q->desc[idx[0]].flags = VRING_DESC_F_NEXT;
+  q->desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
+  q->desc[idx[1]].addr = (uint64) b->data;
+  q->desc[idx[1]].len = BSIZE;
   if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
+    q->desc[idx[1]].flags = 0; // device reads b->data
   else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+    q->desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
+  q->desc[idx[1]].flags |= VRING_DESC_F_NEXT;
+  q->desc[idx[1]].next = idx[2];
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  q->info[idx[0]].status = 0xff; // device writes 0 on success
+  q->desc[idx[2]].addr = (uint64) &q->info[idx[0]].status;
+  q->desc[idx[2]].len = 1;
+  q->desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
+  q->desc[idx[2]].next = 0;
 
   // record struct buf for virtio_disk_intr().
   b->disk = 1;
-  disk.info[idx[0]].b = b;
+  b->queue = q->id;
+  b->qnext = 0;
+  q->info[idx[0]].b = b;
+  q->info[idx[0]].n = 1;
+  q->info[idx[0]].last = idx[1];
+  q->info[idx[0]].write = write;
+  q->info[idx[0]].async = async;
+
+  // kick() puts the chain on the avail ring.
+  q->pending[q->npending++] = idx[0];
+
+  release(&q->lock);
+  return 0;
+}
 
-  // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+// tell the device about all queued requests, on every
+// queue, since the caller may have moved between CPUs
+// while submitting them.
+void
+virtio_disk_kick(void)
+{
+  for(int i = 0; i < disk.nq; i++){
+    struct vq *q = &disk.q[i];
+    acquire(&q->lock);
+    kick(q);
+    release(&q->lock);
+  }
+}
 
-  __sync_synchronize();
+// process the used ring of queue q: wake up processes waiting
+// for finished requests, and add finished async reads to *done.
+// caller must hold q->lock.
+static void
+complete(struct vq *q, struct buf **done)
+{
+  // the device increments q->used->idx when it
+  // adds an entry to the used ring.
 
-  // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  while(q->used_idx != *(volatile uint16*)&q->used->idx){
+    __sync_synchronize();
+    int id = q->used->ring[q->used_idx % NUM].id;
 
-  __sync_synchronize();
+    if(q->info[id].status != 0)
+      panic("virtio_disk_intr status");
+
+    struct buf *b = q->info[id].b;
+    q->info[id].b = 0;
+    free_chain(q, id);
+    while(b){
+      struct buf *next = b->qnext;
+      b->disk = 0;   // disk is done with buf
+      if(q->info[id].async){
+        b->qnext = *done;
+        *done = b;
+      } else {
+        wakeup(b);
+      }
+      b = next;
+    }
+
+    q->used_idx += 1;
+  }
+}
+
+// with EVENT_IDX, ask the device for an interrupt when it adds
+// the next used entry, and not for each of a burst of entries
+// added before the driver looks. entries added while the driver
+// was asking get processed here, since they won't interrupt.
+// caller must hold q->lock.
+static void
+rearm(struct vq *q, struct buf **done)
+{
+  if(!disk.event_idx)
+    return;
+  do {
+    q->avail->used_event = q->used_idx;
+    __sync_synchronize();
+    complete(q, done);
+  } while(q->avail->used_event != q->used_idx);
+}
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+// hand finished async reads to the buffer cache.
+// caller must not hold a queue lock, since bdone()
+// takes buffer cache locks.
+static void
+finish(struct buf *done)
+{
+  while(done){
+    struct buf *b = done;
+    done = b->qnext;
+    bdone(b);
+  }
+}
+
+// wait for a request queued with virtio_disk_submit(b, write, 0)
+// to finish.
+void
+virtio_disk_wait(struct buf *b)
+{
+  struct vq *q = &disk.q[b->queue];
+  struct buf *done = 0;
+
+  acquire(&q->lock);
+  kick(q);
+
+  // poll for a short while first: a fast device often finishes
+  // sooner than a sleep() and interrupt would take. with EVENT_IDX,
+  // the device needn't interrupt meanwhile.
+  if(b->disk == 1){
+    uint64 start = r_time();
+    if(disk.event_idx)
+      q->avail->used_event = q->used_idx - 1;  // not for 64K entries
+    while(b->disk == 1 && r_time() - start < POLLTIME)
+      complete(q, &done);
+    rearm(q, &done);
+  }
 
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+    sleep(b, &q->lock);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  release(&q->lock);
+  finish(done);
+}
 
-  release(&disk.vdisk_lock);
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_submit(b, write, 0);
+  virtio_disk_wait(b);
 }
 
+// the device has a single interrupt for all its queues,
+// so look at every queue.
 void
 virtio_disk_intr()
 {
-  acquire(&disk.vdisk_lock);
+  struct buf *done = 0;  // finished async reads, through qnext
 
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
   // this may race with the device writing new entries to
-  // the "used" ring, in which case we may process the new
+  // the "used" rings, in which case we may process the new
   // completion entries in this interrupt, and have nothing to do
   // in the next interrupt, which is harmless.
   *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
-
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
-
-    disk.used_idx += 1;
+  for(int i = 0; i < disk.nq; i++){
+    struct vq *q = &disk.q[i];
+    acquire(&q->lock);
+    complete(q, &done);
+    rearm(q, &done);
+    release(&q->lock);
   }
 
-  release(&disk.vdisk_lock);
+  // outside the queue locks, since bdone() takes buffer cache locks.
+  finish(done);
 }
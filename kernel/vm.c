@@ -3,8 +3,13 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
 
 /*
  * the kernel's page table.
@@ -165,7 +170,8 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never touched (see vmfault())
+// have no mapping, and are skipped.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
@@ -177,10 +183,15 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+    if((pte = walk(pagetable, a, 0)) == 0){
+      // no page-table page, so nothing mapped
+      // in the rest of this 2-megabyte region.
+      a = ((a >> PXSHIFT(1)) + 1) << PXSHIFT(1);
+      a -= PGSIZE;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -286,6 +297,25 @@ freewalk(pagetable_t pagetable)
   kfree((void*)pagetable);
 }
 
+// Count the user pages mapped in a page table (rss), and
+// how many of them are shared with another page table.
+void
+uvmstat(pagetable_t pagetable, uint64 *rss, uint64 *shared)
+{
+  // there are 2^9 = 512 PTEs in a page table.
+  for(int i = 0; i < 512; i++){
+    pte_t pte = pagetable[i];
+    if((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0){
+      // this PTE points to a lower-level page table.
+      uvmstat((pagetable_t)PTE2PA(pte), rss, shared);
+    } else if((pte & PTE_V) && (pte & PTE_U)){
+      (*rss)++;
+      if(krefcnt((void*)PTE2PA(pte)) > 1)
+        (*shared)++;
+    }
+  }
+}
+
 // Free user memory pages,
 // then free page-table pages.
 void
@@ -296,42 +326,236 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share
+// its memory with a child's page table.
+// Writable pages become read-only copy-on-write
+// pages in both page tables; vmfault() gives a
+// process its own copy when it first writes one.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmcopyrange(old, new, 0, sz, 1);
+}
+
+// Share the pages mapped between va and va+len in old with new,
+// copy-on-write if cow is set, or else writable by both (for
+// MAP_SHARED regions). va must be page-aligned.
+// returns 0 on success, -1 on failure.
+// frees any allocated pages on failure.
+int
+uvmcopyrange(pagetable_t old, pagetable_t new, uint64 va, uint64 len, int cow)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  for(i = va; i < va + len; i += PGSIZE){
+    if((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;  // not yet touched; see vmfault().
+    if(cow && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    kdup((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, va, (i - va) / PGSIZE, 1);
+  return -1;
+}
+
+// Give the page at va its own writable copy
+// of a copy-on-write page.
+// Returns 0 on success, -2 if out of memory.
+static int
+cowcopy(pte_t *pte)
+{
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+  if(krefcnt((void*)pa) == 1){
+    // no one else shares the page any more.
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+  if((mem = kalloc()) == 0)
+    return -2;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  return 0;
+}
+
+// Return p's mmap() region that contains va, or 0.
+struct vma*
+vmafind(struct proc *p, uint64 va)
+{
+  for(int i = 0; i < NVMA; i++){
+    struct vma *v = &p->vma[i];
+    if(v->addr && va >= v->addr && va < v->addr + v->len)
+      return v;
+  }
+  return 0;
+}
+
+// Return the lowest address of p's mmap() regions, which are
+// placed downwards from TRAPFRAME; the heap may not grow past it.
+uint64
+vmabase(struct proc *p)
+{
+  uint64 base = TRAPFRAME;
+
+  for(int i = 0; i < NVMA; i++)
+    if(p->vma[i].addr && p->vma[i].addr < base)
+      base = p->vma[i].addr;
+  return base;
+}
+
+// Map the page at va of region v, which has no page there yet.
+// A file's pages are the page cache's own pages, so that a
+// MAP_SHARED region sees and makes the same changes as read() and
+// write(). They are mapped read-only at first; the first store to
+// one marks it dirty (PTE_D), for munmap() to write back. A
+// MAP_PRIVATE region maps them copy-on-write. Anonymous pages, and
+// those past the end of the file, are zero-filled.
+// Returns like vmfault().
+static int
+vmamap(pagetable_t pagetable, struct vma *v, uint64 va, int write)
+{
+  uint64 off = v->off + (va - v->addr);
+  struct inode *ip;
+  char *mem = 0;
+  int perm, locked;
+
+  if(v->prot == PROT_NONE || (write && (v->prot & PROT_WRITE) == 0))
+    return -1;
+  perm = PTE_R | PTE_U;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+
+  if(v->f){
+    // the fault may come from copyout() while read() or
+    // write() holds the file's lock. they fault in pages of
+    // other files first (see vmaprefault()).
+    ip = v->f->ip;
+    if((locked = holdingsleep(&ip->lock)) == 0)
+      ilock(ip);
+    if(off < ip->size && (mem = pcache_get(ip, off / PGSIZE)) == 0){
+      if(!locked)
+        iunlock(ip);
+      return -2;
+    }
+    if(!locked)
+      iunlock(ip);
+  }
+
+  if(mem == 0){
+    if((mem = kalloc()) == 0)
+      return -2;
+    memset(mem, 0, PGSIZE);
+    if(v->prot & PROT_WRITE)
+      perm |= PTE_W;
+  } else if(v->prot & PROT_WRITE){
+    if((v->flags & MAP_SHARED) == 0)
+      perm |= PTE_COW;
+    else if(write)
+      perm |= PTE_W | PTE_D;
+  }
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -2;
+  }
+  if(write && (perm & PTE_COW))
+    return cowcopy(walk(pagetable, va, 0));
+  return 0;
+}
+
+// Handle a page fault at user virtual address va,
+// e.g. from usertrap() or copyout().
+// write is 1 if the fault was caused by a store.
+// sbrk() only reserves address space, so the first
+// touch of a heap page below p->sz allocates it here,
+// and mmap() regions are filled in by vmamap().
+// Returns 0 if the fault was resolved and the access
+// can be retried, -1 if the access is not allowed, and
+// -2 if memory could not be allocated.
+int
+vmfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v = 0;
+  pte_t *pte;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if(p && pagetable == p->pagetable)
+    v = vmafind(p, va);
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0){
+    if(v)
+      return vmamap(pagetable, v, va, write);
+    if(p == 0 || pagetable != p->pagetable || va >= p->sz)
+      return -1;
+    if((mem = kalloc()) == 0)
+      return -2;
+    memset(mem, 0, PGSIZE);
+    if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_U) != 0){
+      kfree(mem);
+      return -2;
+    }
+    return 0;
+  }
+  if((*pte & PTE_U) == 0)
+    return -1;
+  if(write && (*pte & PTE_COW))
+    return cowcopy(pte);
+  if(write && v && (v->flags & MAP_SHARED) && (v->prot & PROT_WRITE)){
+    // first store to a shared file page.
+    *pte |= PTE_W | PTE_D;
+    return 0;
+  }
   return -1;
 }
 
+// Fault in the pages between va and va+len of the current
+// process's file mappings that aren't mapped yet, for writing if
+// write is set. A caller that copies to or from user memory while
+// holding a lock (another file's, or a spinlock like a pipe's)
+// calls this first, so that vmamap() needn't lock the mapped file
+// then. Pages that can't be mapped are left for the copy to fail on.
+void
+vmaprefault(uint64 va, uint64 len, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 a, end;
+  pte_t *pte;
+
+  if(va + len < va)
+    return;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->addr == 0 || v->f == 0)
+      continue;
+    a = va > v->addr ? PGROUNDDOWN(va) : v->addr;
+    end = va + len < v->addr + v->len ? va + len : v->addr + v->len;
+    for(; a < end; a += PGSIZE){
+      pte = walk(p->pagetable, a, 0);
+      if(pte == 0 || (*pte & PTE_V) == 0)
+        vmfault(p->pagetable, a, write);
+    }
+  }
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -352,12 +576,21 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
+  pte_t *pte;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(va0 >= MAXVA)
       return -1;
+    pte = walk(pagetable, va0, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_W) == 0){
+      if(vmfault(pagetable, va0, 1) < 0)
+        return -1;
+      pte = walk(pagetable, va0, 0);
+    }
+    if((*pte & PTE_U) == 0 || (*pte & PTE_W) == 0)
+      return -1;
+    pa0 = PTE2PA(*pte);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -381,8 +614,11 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0){
+      if(vmfault(pagetable, va0, 0) < 0)
+        return -1;
+      pa0 = walkaddr(pagetable, va0);
+    }
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
@@ -408,8 +644,11 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0){
+      if(vmfault(pagetable, va0, 0) < 0)
+        return -1;
+      pa0 = walkaddr(pagetable, va0);
+    }
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
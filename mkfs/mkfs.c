@@ -20,9 +20,10 @@
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
 
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
+uint fssize = FSSIZE;  // Size of file system in blocks (-s)
+int nbitmap;  // Number of bitmap blocks
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = LOGBLOCKS;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -32,6 +33,11 @@ char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
+// entries of the root directory, written by rootdir()
+// once all the files are in.
+struct dirent rootent[NINODES];
+int nrootent;
+
 
 void balloc(int);
 void wsect(uint, void*);
@@ -40,6 +46,8 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void rootlink(char *name, uint inum);
+void rootdir(uint rootino);
 void die(const char *);
 
 // convert to riscv byte order
@@ -69,45 +77,56 @@ int
 main(int argc, char *argv[])
 {
   int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
+  uint rootino, inum;
   char buf[BSIZE];
-  struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  if(argc > 2 && strcmp(argv[1], "-s") == 0){
+    fssize = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-s blocks] fs.img files...\n");
     exit(1);
   }
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert(sizeof(struct dirindex) == BSIZE);
+  assert((1 << DIRMAXDEPTH) <= DIRNLEAF * (BSIZE / sizeof(struct dirent) - 1));
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0)
     die(argv[1]);
 
   // 1 fs block = 1 disk sector
+  nbitmap = fssize/BPB + 1;
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  if(fssize <= nmeta){
+    fprintf(stderr, "mkfs: %u blocks is too small\n", fssize);
+    exit(1);
+  }
+  nblocks = fssize - nmeta;
 
   sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
   sb.ninodes = xint(NINODES);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.bsize = xint(BSIZE);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
+  for(i = 0; i < fssize; i++)
     wsect(i, zeroes);
 
   memset(buf, 0, sizeof(buf));
@@ -117,15 +136,8 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  rootlink(".", rootino);
+  rootlink("..", rootino);
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -148,11 +160,7 @@ main(int argc, char *argv[])
       shortname += 1;
 
     inum = ialloc(T_FILE);
-
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    rootlink(shortname, inum);
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -160,12 +168,7 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  rootdir(rootino);
 
   balloc(freeblock);
 
@@ -249,6 +252,21 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return entry i of indirect block ind,
+// allocating a block for it if there is none.
+uint
+ientry(uint ind, uint i)
+{
+  uint a[NINDIRECT];
+
+  rsect(ind, (char*)a);
+  if(a[i] == 0){
+    a[i] = xint(freeblock++);
+    wsect(ind, (char*)a);
+  }
+  return xint(a[i]);
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -256,8 +274,8 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
-  uint x;
+  uint x, bn, span;
+  int level;
 
   rinode(inum, &din);
   off = xint(din.size);
@@ -271,15 +289,23 @@ iappend(uint inum, void *xp, int n)
       }
       x = xint(din.addrs[fbn]);
     } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
+      // find the indirect, double- or triple-indirect
+      // block that maps fbn, and walk down from it.
+      bn = fbn - NDIRECT;
+      span = NINDIRECT;
+      for(level = 1; bn >= span; level++){
+        bn -= span;
+        span *= NINDIRECT;
       }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+      if(xint(din.addrs[NDIRECT+level-1]) == 0){
+        din.addrs[NDIRECT+level-1] = xint(freeblock++);
+      }
+      x = xint(din.addrs[NDIRECT+level-1]);
+      for(; level > 0; level--){
+        span /= NINDIRECT;
+        x = ientry(x, bn / span);
+        bn %= span;
       }
-      x = xint(indirect[fbn-NDIRECT]);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
@@ -293,6 +319,87 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+void
+rootlink(char *name, uint inum)
+{
+  struct dirent *de;
+
+  assert(nrootent < NINODES);
+  de = &rootent[nrootent++];
+  bzero(de, sizeof(*de));
+  de->inum = xshort(inum);
+  strncpy(de->name, name, DIRSIZ);
+}
+
+// FNV-1a hash of a directory entry name,
+// as dirhash() in kernel/fs.c.
+uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Write the entries of the root directory: one after another
+// if they fit in a block, and otherwise as a hashed directory,
+// with the fewest leaves that hold them.
+void
+rootdir(uint rootino)
+{
+  int per = BSIZE / sizeof(struct dirent);
+  int count[1 << DIRMAXDEPTH];
+  struct dirent leaf[BSIZE / sizeof(struct dirent)];
+  struct dirindex ix;
+  struct dinode din;
+  uint off, mask;
+  int depth, i, n, slot, full;
+
+  if(nrootent <= per){
+    iappend(rootino, rootent, nrootent * sizeof(struct dirent));
+
+    // fix size of root inode dir
+    rinode(rootino, &din);
+    off = xint(din.size);
+    off = ((off/BSIZE) + 1) * BSIZE;
+    din.size = xint(off);
+    winode(rootino, &din);
+    return;
+  }
+
+  for(depth = 0; ; depth++){
+    assert(depth <= DIRMAXDEPTH);
+    mask = (1 << depth) - 1;
+    bzero(count, sizeof(count));
+    full = 0;
+    for(i = 0; i < nrootent; i++)
+      if(++count[dirhash(rootent[i].name) & mask] > per)
+        full = 1;
+    if(!full)
+      break;
+  }
+
+  bzero(&ix, sizeof(ix));
+  memmove(ix.magic, DIRMAGIC, sizeof(ix.magic));
+  ix.depth = xshort(depth);
+  for(slot = 0; slot <= mask; slot++)
+    DIRLEAF(&ix, slot) = xshort(1 + slot);
+  iappend(rootino, &ix, BSIZE);
+
+  for(slot = 0; slot <= mask; slot++){
+    bzero(leaf, sizeof(leaf));
+    n = 0;
+    for(i = 0; i < nrootent; i++)
+      if((dirhash(rootent[i].name) & mask) == slot)
+        leaf[n++] = rootent[i];
+    iappend(rootino, leaf, BSIZE);
+  }
+}
+
 void
 die(const char *s)
 {
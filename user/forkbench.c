@@ -0,0 +1,68 @@
+// Measure the latency of fork() followed by exec().
+//
+// For each heap size, time N iterations of fork+exec two ways:
+//   cow:   the child execs immediately, as the shell does,
+//          so copy-on-write fork never copies a page.
+//   eager: the child first writes to every heap page, which
+//          copies each page just as the old eager uvmcopy() did
+//          on every fork.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define N 50
+
+char *xargv[] = { "forkbench", "-x", 0 };
+
+int
+run(char *heap, int npages, int eager)
+{
+  int start, i, pid;
+
+  start = uptime();
+  for(i = 0; i < N; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("forkbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      if(eager){
+        for(int j = 0; j < npages; j++)
+          heap[j * 4096] = 1;
+      }
+      exec(xargv[0], xargv);
+      printf("forkbench: exec failed\n");
+      exit(1);
+    }
+    wait(0);
+  }
+  return uptime() - start;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int sizes[] = { 0, 64, 512 };  // heap pages
+
+  if(argc > 1 && strcmp(argv[1], "-x") == 0)
+    exit(0);
+
+  for(int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+    int npages = sizes[i];
+    char *p = sbrk(npages * 4096);
+    if(p == (char*)-1){
+      printf("forkbench: sbrk failed\n");
+      exit(1);
+    }
+    for(int j = 0; j < npages; j++)
+      p[j * 4096] = 1;
+    int cow = run(p, npages, 0);
+    int eager = run(p, npages, 1);
+    printf("heap %d KB, %d fork+exec: cow %d ticks, eager %d ticks\n",
+           npages * 4, N, cow, eager);
+    sbrk(-npages * 4096);
+  }
+  exit(0);
+}
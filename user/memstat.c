@@ -0,0 +1,40 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+// print memory statistics for each pid given,
+// or for this process if there are none.
+
+void
+show(int pid)
+{
+  struct memstat st;
+
+  if(memstat(pid, &st) < 0){
+    fprintf(2, "memstat: no process %d\n", pid);
+    return;
+  }
+  printf("pid %d: size %d KB, rss %d KB, shared %d KB\n",
+         pid ? pid : getpid(), (int)(st.sz / 1024),
+         (int)st.rss * 4, (int)st.shared * 4);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct memstat st;
+  int i;
+
+  if(argc < 2)
+    show(0);
+  for(i = 1; i < argc; i++)
+    show(atoi(argv[i]));
+
+  if(memstat(0, &st) < 0)
+    exit(1);
+  printf("free %d of %d pages, reclaimed %d, oom kills %d\n",
+         (int)st.freepages, (int)st.totalpages,
+         (int)st.reclaimed, (int)st.oomkills);
+  exit(0);
+}
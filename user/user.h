@@ -1,4 +1,6 @@
 struct stat;
+struct memstat;
+struct iovec;
 
 // system calls
 int fork(void);
@@ -22,6 +24,17 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int memstat(int, struct memstat*);
+int fsync(int);
+#ifdef FSCRASH
+int fscrash(void);
+#endif
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
+int pread(int, void*, int, int);
+int pwrite(int, const void*, int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -1,6 +1,8 @@
 #include "kernel/param.h"
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/memstat.h"
+#include "kernel/uio.h"
 #include "user/user.h"
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
@@ -575,10 +577,296 @@ writetest(char *s)
   }
 }
 
+// fsync() waits for the log writer to commit a file's
+// updates; it only makes sense for files.
+void
+fsynctest(char *s)
+{
+  int fd, fds[2];
+
+  fd = open("fsyncf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create fsyncf failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < 20; i++){
+    if(write(fd, "aaaaaaaaaa", 10) != 10){
+      printf("%s: write fsyncf failed\n", s);
+      exit(1);
+    }
+    if(fsync(fd) != 0){
+      printf("%s: fsync failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  if(fsync(fd) != -1){
+    printf("%s: fsync of a closed fd succeeded\n", s);
+    exit(1);
+  }
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(fsync(fds[0]) != -1){
+    printf("%s: fsync of a pipe succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  fd = open("fsyncf", O_RDONLY);
+  if(read(fd, buf, sizeof(buf)) != 200){
+    printf("%s: fsyncf has the wrong size\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("fsyncf");
+}
+
+#ifdef FSCRASH
+// fscrash() recovers the file system from the log as if it
+// had crashed: the blocks the log hasn't yet checkpointed get
+// their logged contents back. Nothing written should be lost.
+void
+logcrash(char *s)
+{
+  int fd, i, round, n, replayed = 0;
+
+  for(round = 0; round < 3; round++){
+    fd = open("logcrash", O_CREATE|O_RDWR);
+    if(fd < 0){
+      printf("%s: create logcrash failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < 8; i++){
+      memset(buf, 'a' + round + i, BSIZE);
+      if(write(fd, buf, BSIZE) != BSIZE){
+        printf("%s: write logcrash failed\n", s);
+        exit(1);
+      }
+    }
+    close(fd);
+    // overwrite the first block, so that the log holds it twice.
+    fd = open("logcrash", O_RDWR);
+    memset(buf, 'A' + round, BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: rewrite logcrash failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    fd = open("logcrash.gone", O_CREATE|O_RDWR);
+    close(fd);
+    unlink("logcrash.gone");
+
+    if((n = fscrash()) < 0){
+      printf("%s: fscrash failed\n", s);
+      exit(1);
+    }
+    replayed += n;
+
+    fd = open("logcrash", O_RDONLY);
+    if(fd < 0){
+      printf("%s: logcrash lost\n", s);
+      exit(1);
+    }
+    for(i = 0; i < 8; i++){
+      if(read(fd, buf, BSIZE) != BSIZE){
+        printf("%s: read logcrash failed\n", s);
+        exit(1);
+      }
+      char c = i == 0 ? 'A' + round : 'a' + round + i;
+      if(buf[0] != c || buf[BSIZE-1] != c){
+        printf("%s: block %d of logcrash is wrong\n", s, i);
+        exit(1);
+      }
+    }
+    if(read(fd, buf, 1) != 0){
+      printf("%s: logcrash too long\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(open("logcrash.gone", O_RDONLY) >= 0){
+      printf("%s: unlinked file came back\n", s);
+      exit(1);
+    }
+    if(unlink("logcrash") < 0){
+      printf("%s: unlink logcrash failed\n", s);
+      exit(1);
+    }
+  }
+  if(replayed == 0){
+    printf("%s: recovery found nothing in the log\n", s);
+    exit(1);
+  }
+}
+
+// blocks that a write appends to a file go straight home rather
+// than through the log. they must survive a crash, and a block
+// whose older contents the log still holds (round 0: blocks of a
+// file that was overwritten and removed) must not get those
+// contents back when a new file reuses it. nor may a new file's
+// blocks go home while the removal of the file that held them
+// (round 1: a committed file of appended blocks) is uncommitted.
+void
+appendcrash(char *s)
+{
+  enum { NB = BUFSZ / BSIZE, N = 3 * NB };
+  int fd, i, j, round;
+
+  for(round = 0; round < 3; round++){
+    if(round == 1){
+      fd = open("appendcrash.old", O_CREATE|O_RDWR|O_TRUNC);
+      if(fd < 0){
+        printf("%s: create appendcrash.old failed\n", s);
+        exit(1);
+      }
+      memset(buf, 'o', BUFSZ);
+      for(i = 0; i < N; i += NB){
+        if(write(fd, buf, BUFSZ) != BUFSZ){
+          printf("%s: write appendcrash.old failed\n", s);
+          exit(1);
+        }
+      }
+      if(fsync(fd) < 0){
+        printf("%s: fsync appendcrash.old failed\n", s);
+        exit(1);
+      }
+      close(fd);
+      unlink("appendcrash.old");
+    }
+    fd = open("appendcrash", O_CREATE|O_RDWR|O_TRUNC);
+    if(fd < 0){
+      printf("%s: create appendcrash failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < N; i += NB){
+      for(j = 0; j < NB; j++)
+        memset(buf + j*BSIZE, 'a' + (round + i + j) % 26, BSIZE);
+      if(write(fd, buf, BUFSZ) != BUFSZ){
+        printf("%s: write appendcrash failed\n", s);
+        exit(1);
+      }
+    }
+    if(write(fd, "tail", 4) != 4){
+      printf("%s: write tail failed\n", s);
+      exit(1);
+    }
+    if(round == 0){
+      // overwrite every block, so that the log holds them.
+      memset(buf, 'X', BSIZE);
+      for(i = 0; i < N; i++){
+        if(pwrite(fd, buf, BSIZE, i * BSIZE) != BSIZE){
+          printf("%s: overwrite appendcrash failed\n", s);
+          exit(1);
+        }
+      }
+      close(fd);
+      unlink("appendcrash");
+      continue;
+    }
+    close(fd);
+
+    if(fscrash() < 0){
+      printf("%s: fscrash failed\n", s);
+      exit(1);
+    }
+    if(round == 1 && open("appendcrash.old", O_RDONLY) >= 0){
+      printf("%s: appendcrash.old came back\n", s);
+      exit(1);
+    }
+
+    fd = open("appendcrash", O_RDONLY);
+    if(fd < 0){
+      printf("%s: appendcrash lost\n", s);
+      exit(1);
+    }
+    for(i = 0; i < N; i++){
+      if(read(fd, buf, BSIZE) != BSIZE){
+        printf("%s: read appendcrash failed\n", s);
+        exit(1);
+      }
+      for(j = 0; j < BSIZE; j++){
+        if(buf[j] != 'a' + (round + i) % 26){
+          printf("%s: block %d of appendcrash is wrong\n", s, i);
+          exit(1);
+        }
+      }
+    }
+    if(read(fd, buf, BSIZE) != 4 || memcmp(buf, "tail", 4) != 0){
+      printf("%s: tail of appendcrash is wrong\n", s);
+      exit(1);
+    }
+    close(fd);
+    unlink("appendcrash");
+  }
+}
+
+// file blocks that start like the log's descriptor ("logd")
+// and commit ("logc") blocks must survive a trip through the log.
+void
+logmagic(char *s)
+{
+  char *magic[] = { "logd", "logc" };
+  int fd, i;
+
+  fd = open("logmagic", O_CREATE|O_RDWR|O_TRUNC);
+  if(fd < 0){
+    printf("%s: create logmagic failed\n", s);
+    exit(1);
+  }
+  memset(buf, 0, BSIZE);
+  for(i = 0; i < 2; i++){
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write logmagic failed\n", s);
+      exit(1);
+    }
+  }
+  // overwrite the blocks, so that they go through the log.
+  for(i = 0; i < 2; i++){
+    memset(buf, 'x', BSIZE);
+    memmove(buf, magic[i], 4);
+    if(pwrite(fd, buf, BSIZE, i * BSIZE) != BSIZE){
+      printf("%s: overwrite logmagic failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  if(fscrash() < 0){
+    printf("%s: fscrash failed\n", s);
+    exit(1);
+  }
+
+  fd = open("logmagic", O_RDONLY);
+  if(fd < 0){
+    printf("%s: logmagic lost\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2; i++){
+    if(read(fd, buf, BSIZE) != BSIZE){
+      printf("%s: read logmagic failed\n", s);
+      exit(1);
+    }
+    if(memcmp(buf, magic[i], 4) != 0 || buf[4] != 'x' || buf[BSIZE-1] != 'x'){
+      printf("%s: block %d of logmagic is wrong\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("logmagic");
+}
+#endif
+
+// enough blocks to need the double-indirect block.
+#define BIGBLOCKS (NDIRECT + NINDIRECT + 2*NINDIRECT)
+
 void
 writebig(char *s)
 {
   int i, fd, n;
+  struct stat st;
 
   fd = open("big", O_CREATE|O_RDWR);
   if(fd < 0){
@@ -586,7 +874,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGBLOCKS; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -606,7 +894,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != BIGBLOCKS){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -623,6 +911,18 @@ writebig(char *s)
     n++;
   }
   close(fd);
+
+  // truncating it frees blocks over several transactions.
+  fd = open("big", O_RDWR|O_TRUNC);
+  if(fd < 0){
+    printf("%s: error: truncate big failed!\n", s);
+    exit(1);
+  }
+  if(fstat(fd, &st) < 0 || st.size != 0 || read(fd, buf, BSIZE) != 0){
+    printf("%s: big not empty after O_TRUNC\n", s);
+    exit(1);
+  }
+  close(fd);
   if(unlink("big") < 0){
     printf("%s: unlink big failed\n", s);
     exit(1);
@@ -1953,6 +2253,140 @@ iref(char *s)
   chdir("/");
 }
 
+// the name lookup cache must follow creates and unlinks,
+// and must forget the names in a directory that is freed,
+// since a new directory may get the same inode number.
+void
+dcachetest(char *s)
+{
+  int fd, i;
+  struct stat st;
+
+  if(mkdir("dcache.a") < 0 || mkdir("dcache.b") < 0){
+    printf("%s: mkdir failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 10; i++){
+    if(open("dcache.f", O_RDONLY) >= 0){
+      printf("%s: opened dcache.f before creating it\n", s);
+      exit(1);
+    }
+    fd = open("dcache.f", O_CREATE|O_RDWR);
+    if(fd < 0){
+      printf("%s: create dcache.f failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(stat("dcache.f", &st) < 0){
+      printf("%s: stat dcache.f failed\n", s);
+      exit(1);
+    }
+    if(unlink("dcache.f") < 0){
+      printf("%s: unlink dcache.f failed\n", s);
+      exit(1);
+    }
+    if(stat("dcache.f", &st) >= 0){
+      printf("%s: dcache.f still there after unlink\n", s);
+      exit(1);
+    }
+
+    // a directory freed in one parent and reallocated in the
+    // other must not keep the old parent's "..".
+    char *parent = i % 2 ? "dcache.b" : "dcache.a";
+    char path[16];
+    struct stat pst;
+    strcpy(path, parent);
+    strcpy(path + strlen(path), "/d/..");
+    if(stat(parent, &pst) < 0){
+      printf("%s: stat %s failed\n", s, parent);
+      exit(1);
+    }
+    path[strlen(parent) + 2] = 0;
+    if(mkdir(path) < 0){
+      printf("%s: mkdir %s failed\n", s, path);
+      exit(1);
+    }
+    path[strlen(parent) + 2] = '/';
+    if(stat(path, &st) < 0 || st.ino != pst.ino){
+      printf("%s: %s is not %s\n", s, path, parent);
+      exit(1);
+    }
+    path[strlen(parent) + 2] = 0;
+    if(unlink(path) < 0){
+      printf("%s: unlink %s failed\n", s, path);
+      exit(1);
+    }
+  }
+  unlink("dcache.a");
+  unlink("dcache.b");
+}
+
+// hold more inodes open at once than the NINODE minimum
+// of the inode cache; iget() used to panic.
+void
+manyinodes(char *s)
+{
+  enum { NCHILD = 6, NFILE = NOFILE - 4 };
+  int ready[2], done[2], pid, i, j;
+  char name[16], c;
+
+  if(pipe(ready) < 0 || pipe(done) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(done[1]);
+      for(j = 0; j < NFILE; j++){
+        name[0] = 'm';
+        name[1] = 'i';
+        name[2] = 'a' + i;
+        name[3] = 'a' + j;
+        name[4] = 0;
+        if(open(name, O_CREATE|O_RDWR) < 0){
+          printf("%s: create %s failed\n", s, name);
+          write(ready[1], "f", 1);
+          exit(1);
+        }
+      }
+      write(ready[1], "x", 1);
+      read(done[0], &c, 1);  // hold the files until the parent says
+      exit(0);
+    }
+  }
+  close(done[0]);
+  for(i = 0; i < NCHILD; i++){
+    if(read(ready[0], &c, 1) != 1 || c != 'x'){
+      printf("%s: a child failed\n", s);
+      exit(1);
+    }
+  }
+  close(done[1]);
+  for(i = 0; i < NCHILD; i++){
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  close(ready[0]);
+  close(ready[1]);
+  for(i = 0; i < NCHILD; i++){
+    for(j = 0; j < NFILE; j++){
+      name[0] = 'm';
+      name[1] = 'i';
+      name[2] = 'a' + i;
+      name[3] = 'a' + j;
+      name[4] = 0;
+      unlink(name);
+    }
+  }
+}
+
 // test that fork fails gracefully
 // the forktest binary also does this, but it runs out of proc entries first.
 // inside the bigger usertests binary, we run out of memory first.
@@ -1993,6 +2427,55 @@ forktest(char *s)
   }
 }
 
+// copy-on-write fork: fork() must share the parent's memory
+// rather than copy it, so that a process using most of physical
+// memory can still fork, and writes must stay private.
+void
+cowfork(char *s)
+{
+  uint64 sz = (PHYSTOP - KERNBASE) / 3 * 2;
+  int ppid = getpid();
+  char *p, *q;
+
+  p = sbrk(sz);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, sz);
+    exit(1);
+  }
+  for(q = p; q < p + sz; q += PGSIZE)
+    *(int*)q = ppid;
+
+  for(int i = 0; i < 2; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(q = p; q < p + sz; q += 64*PGSIZE){
+        if(*(int*)q != ppid){
+          printf("%s: child saw wrong value\n", s);
+          exit(1);
+        }
+        *(int*)q = getpid();
+      }
+      exit(0);
+    }
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+
+  for(q = p; q < p + sz; q += PGSIZE){
+    if(*(int*)q != ppid){
+      printf("%s: child write visible in parent\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-sz);
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2554,17 +3037,138 @@ sbrk8000(char *s)
   *(top-1) = *(top-1) + 1;
 }
 
-
-
-// regression test. test whether exec() leaks memory if one of the
-// arguments is invalid. the test passes if the kernel doesn't panic.
+// sbrk() only reserves address space, so a heap much larger
+// than physical memory can be allocated as long as only a few
+// of its pages are touched, including by system calls and by
+// a forked child.
 void
-badarg(char *s)
+sbrklazy(char *s)
 {
-  for(int i = 0; i < 50000; i++){
-    char *argv[2];
-    argv[0] = (char*)0xffffffff;
-    argv[1] = 0;
+  uint64 big = 1024*1024*1024;
+  char *a = sbrk(big);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk of a sparse 1 GB heap failed\n", s);
+    exit(1);
+  }
+
+  for(uint64 i = 0; i < big; i += big/16){
+    if(a[i] != 0){
+      printf("%s: untouched heap page not zero\n", s);
+      exit(1);
+    }
+    a[i] = 'x';
+  }
+
+  // copyout() and copyin() into pages never touched by the process.
+  int fd = open("README", 0);
+  if(fd < 0){
+    printf("%s: open README failed\n", s);
+    exit(1);
+  }
+  if(read(fd, a + big/2 + 8192, 100) != 100){
+    printf("%s: read into lazy page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  int fds[2];
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], a + big/2 + 3*8192, 10) != 10){
+    printf("%s: write from lazy page failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(a[big/16] != 'x' || a[big - 1] != 0)
+      exit(1);
+    exit(0);
+  }
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong heap contents\n", s);
+    exit(1);
+  }
+
+  if(sbrk(-big) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+}
+
+// memstat() should count resident pages: none for untouched
+// heap, and shared ones in a child after fork().
+void
+memstattest(char *s)
+{
+  struct memstat st0, st1;
+  int npages = 64;
+
+  if(memstat(0, &st0) < 0){
+    printf("%s: memstat failed\n", s);
+    exit(1);
+  }
+  if(st0.rss == 0 || st0.rss > st0.totalpages || st0.freepages > st0.totalpages){
+    printf("%s: bogus memstat\n", s);
+    exit(1);
+  }
+  if(memstat(-1, &st1) != -1){
+    printf("%s: memstat of a bad pid succeeded\n", s);
+    exit(1);
+  }
+
+  char *a = sbrk(npages * 4096);
+  memstat(0, &st1);
+  if(st1.sz != st0.sz + npages * 4096 || st1.rss != st0.rss){
+    printf("%s: rss grew before the heap was touched\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < npages; i++)
+    a[i * 4096] = i;
+  memstat(0, &st1);
+  if(st1.rss < st0.rss + npages){
+    printf("%s: rss %d did not grow by %d\n", s, (int)(st1.rss - st0.rss), npages);
+    exit(1);
+  }
+
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    memstat(0, &st1);
+    exit(st1.shared >= npages ? 0 : 1);
+  }
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child did not share the parent's heap\n", s);
+    exit(1);
+  }
+  sbrk(-npages * 4096);
+}
+
+
+
+// regression test. test whether exec() leaks memory if one of the
+// arguments is invalid. the test passes if the kernel doesn't panic.
+void
+badarg(char *s)
+{
+  for(int i = 0; i < 50000; i++){
+    char *argv[2];
+    argv[0] = (char*)0xffffffff;
+    argv[1] = 0;
     exec("echo", argv);
   }
   
@@ -2589,6 +3193,12 @@ struct test {
   {iputtest, "iput"},
   {opentest, "opentest"},
   {writetest, "writetest"},
+  {fsynctest, "fsynctest"},
+#ifdef FSCRASH
+  {logcrash, "logcrash"},
+  {appendcrash, "appendcrash"},
+  {logmagic, "logmagic"},
+#endif
   {writebig, "writebig"},
   {createtest, "createtest"},
   {dirtest, "dirtest"},
@@ -2617,7 +3227,10 @@ struct test {
   {rmdot, "rmdot"},
   {dirfile, "dirfile"},
   {iref, "iref"},
+  {manyinodes, "manyinodes"},
+  {dcachetest, "dcachetest"},
   {forktest, "forktest"},
+  {cowfork, "cowfork"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
   {kernmem, "kernmem"},
@@ -2634,6 +3247,8 @@ struct test {
   {sbrkbugs, "sbrkbugs" },
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
+  {sbrklazy, "sbrklazy"},
+  {memstattest, "memstattest"},
   {badarg, "badarg" },
 
   { 0, 0},
@@ -2684,6 +3299,510 @@ bigdir(char *s)
   }
 }
 
+// file reads come from the page cache, which must see
+// overwrites and truncation.
+void
+pagecache(char *s)
+{
+  enum { N = 3*4096 + 100, M = 5000 };
+  static char buf[N];
+  int fd, i, n, tot;
+
+  for(i = 0; i < N; i++)
+    buf[i] = i % 251;
+  fd = open("pc", O_CREATE|O_RDWR|O_TRUNC);
+  if(fd < 0 || write(fd, buf, N) != N){
+    printf("%s: write pc failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  for(int round = 0; round < 2; round++){
+    // the first round fills the cache, the second reads from it.
+    memset(buf, 0, N);
+    fd = open("pc", O_RDONLY);
+    for(tot = 0; (n = read(fd, buf + tot, 700)) > 0; tot += n)
+      ;
+    close(fd);
+    if(tot != N){
+      printf("%s: read %d bytes, not %d\n", s, tot, N);
+      exit(1);
+    }
+    for(i = 0; i < N; i++){
+      if(buf[i] != (char)(i % 251)){
+        printf("%s: wrong byte at %d\n", s, i);
+        exit(1);
+      }
+    }
+  }
+
+  // overwrite the start of the cached file.
+  memset(buf, 'x', M);
+  fd = open("pc", O_RDWR);
+  if(write(fd, buf, M) != M){
+    printf("%s: overwrite pc failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  memset(buf, 0, N);
+  fd = open("pc", O_RDONLY);
+  if(read(fd, buf, N) != N){
+    printf("%s: reread pc failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < N; i++){
+    if(buf[i] != (i < M ? 'x' : (char)(i % 251))){
+      printf("%s: wrong byte at %d after overwrite\n", s, i);
+      exit(1);
+    }
+  }
+
+  // truncate it; the old pages must not show through.
+  fd = open("pc", O_RDWR|O_TRUNC);
+  if(write(fd, "hello", 5) != 5){
+    printf("%s: write after truncate failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  memset(buf, 0, N);
+  fd = open("pc", O_RDONLY);
+  n = read(fd, buf, N);
+  close(fd);
+  if(n != 5 || memcmp(buf, "hello", 5) != 0){
+    printf("%s: read %d bytes after truncate\n", s, n);
+    exit(1);
+  }
+  unlink("pc");
+}
+
+// mmap() of files and anonymous memory: private and shared
+// mappings, write-back on munmap(), partial unmaps and fork().
+void
+mmaptest(char *s)
+{
+  enum { N = 2*PGSIZE + 500 };
+  static char buf[N];
+  char *m, *m2;
+  int fd, i, pid, xst;
+
+  for(i = 0; i < N; i++)
+    buf[i] = 'a' + i % 23;
+  fd = open("mm", O_CREATE|O_RDWR|O_TRUNC);
+  if(fd < 0 || write(fd, buf, N) != N){
+    printf("%s: write mm failed\n", s);
+    exit(1);
+  }
+
+  // private: reads the file, zeros past its end, and
+  // stores don't reach the file.
+  m = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(m == (char*)-1){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(m[i] != buf[i]){
+      printf("%s: private mapping wrong at %d\n", s, i);
+      exit(1);
+    }
+  }
+  for(i = N; i < PGROUNDUP(N); i++){
+    if(m[i] != 0){
+      printf("%s: nonzero past end of file\n", s);
+      exit(1);
+    }
+  }
+  m[0] = 'X';
+  if(munmap(m, N) != 0){
+    printf("%s: munmap private failed\n", s);
+    exit(1);
+  }
+
+  // shared: stores are written back by munmap(). unmap the
+  // middle page first; the others must stay mapped.
+  m = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(m == (char*)-1){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(m[0] != 'a'){
+    printf("%s: private store reached the file\n", s);
+    exit(1);
+  }
+  m[0] = 'Y';
+  m[PGSIZE] = 'Z';
+  m[2*PGSIZE] = 'W';
+  if(munmap(m + PGSIZE, PGSIZE) != 0){
+    printf("%s: munmap middle failed\n", s);
+    exit(1);
+  }
+  m[1] = 'V';
+  if(munmap(m, PGSIZE) != 0 || munmap(m + 2*PGSIZE, N - 2*PGSIZE) != 0){
+    printf("%s: munmap shared failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  memset(buf, 0, N);
+  fd = open("mm", O_RDONLY);
+  if(read(fd, buf, N) != N || buf[0] != 'Y' || buf[1] != 'V' ||
+     buf[PGSIZE] != 'Z' || buf[2*PGSIZE] != 'W'){
+    printf("%s: shared stores not written back\n", s);
+    exit(1);
+  }
+
+  // a read-only file can't take a writable shared mapping.
+  if(mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != (char*)-1){
+    printf("%s: writable mapping of read-only fd\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mm");
+
+  // anonymous: a MAP_SHARED page is shared with a child,
+  // a MAP_PRIVATE one is copied.
+  m = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  m2 = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(m == (char*)-1 || m2 == (char*)-1){
+    printf("%s: mmap anonymous failed\n", s);
+    exit(1);
+  }
+  m[0] = 1;
+  m2[0] = 1;
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    m[0] = 2;
+    m2[0] = 2;
+    exit(0);
+  }
+  wait(0);
+  if(m[0] != 2 || m2[0] != 1){
+    printf("%s: anonymous mappings not shared/copied right\n", s);
+    exit(1);
+  }
+  munmap(m, PGSIZE);
+  munmap(m2, PGSIZE);
+
+  // a MAP_SHARED page is shared even if first touched after fork().
+  m = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(m == (char*)-1){
+    printf("%s: mmap anonymous failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    m[0] = 4;
+    m[PGSIZE] = 5;
+    exit(0);
+  }
+  wait(0);
+  if(m[0] != 4 || m[PGSIZE] != 5){
+    printf("%s: untouched shared page not shared\n", s);
+    exit(1);
+  }
+  munmap(m, 2*PGSIZE);
+
+  // touching an unmapped region kills the process.
+  pid = fork();
+  if(pid == 0){
+    m[0] = 3;
+    exit(0);
+  }
+  wait(&xst);
+  if(xst != -1){
+    printf("%s: store to unmapped page survived\n", s);
+    exit(1);
+  }
+}
+
+// processes that write() from a mapping of one file to another,
+// with the files crossed, must not deadlock on their two locks.
+void
+mmapcross(char *s)
+{
+  enum { N = 4*PGSIZE };
+  char *names[2] = { "mxa", "mxb" };
+  int fd, fd2, i, j, pid, xst;
+  char *m;
+
+  for(i = 0; i < 2; i++){
+    memset(buf, 'a' + i, PGSIZE);
+    fd = open(names[i], O_CREATE|O_RDWR|O_TRUNC);
+    for(j = 0; j < N / PGSIZE; j++){
+      if(fd < 0 || write(fd, buf, PGSIZE) != PGSIZE){
+        printf("%s: write %s failed\n", s, names[i]);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+
+  for(i = 0; i < 2; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(j = 0; j < 10; j++){
+        fd = open(names[i], O_RDONLY);
+        fd2 = open(names[1-i], O_RDWR);
+        m = mmap(0, N, PROT_READ, MAP_SHARED, fd, 0);
+        if(fd < 0 || fd2 < 0 || m == (char*)-1)
+          exit(1);
+        if(write(fd2, m, N) != N)
+          exit(1);
+        munmap(m, N);
+        close(fd);
+        close(fd2);
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < 2; i++){
+    wait(&xst);
+    if(xst != 0){
+      printf("%s: crossed write from mapping failed\n", s);
+      exit(1);
+    }
+  }
+  unlink("mxa");
+  unlink("mxb");
+}
+
+// readv() and writev() move several buffers at once, and
+// pread() and pwrite() use an offset of their own, so that
+// processes sharing a descriptor don't disturb one another.
+void
+iovtest(char *s)
+{
+  char a[10], b[3000], c[5], buf[3100];
+  struct iovec iov[MAXIOV+1];
+  int fd, fds[2], i, pid, xst;
+
+  memset(a, 'a', sizeof(a));
+  memset(b, 'b', sizeof(b));
+  memset(c, 'c', sizeof(c));
+  iov[0].iov_base = a;
+  iov[0].iov_len = sizeof(a);
+  iov[1].iov_base = b;
+  iov[1].iov_len = sizeof(b);
+  iov[2].iov_base = c;
+  iov[2].iov_len = sizeof(c);
+  fd = open("iov", O_CREATE|O_RDWR|O_TRUNC);
+  if(fd < 0 || writev(fd, iov, 3) != 3015){
+    printf("%s: writev failed\n", s);
+    exit(1);
+  }
+  if(write(fd, "z", 1) != 1){
+    printf("%s: write after writev failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("iov", O_RDONLY);
+  if(read(fd, buf, sizeof(buf)) != 3016){
+    printf("%s: wrong size after writev\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 3016; i++){
+    if(buf[i] != (i < 10 ? 'a' : i < 3010 ? 'b' : i < 3015 ? 'c' : 'z')){
+      printf("%s: wrong byte at %d after writev\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  // readv fills each buffer in turn; the last is short.
+  memset(a, 0, sizeof(a));
+  memset(b, 0, sizeof(b));
+  memset(c, 0, sizeof(c));
+  iov[2].iov_base = buf;
+  iov[2].iov_len = sizeof(buf);
+  fd = open("iov", O_RDONLY);
+  if(readv(fd, iov, 3) != 3016){
+    printf("%s: readv failed\n", s);
+    exit(1);
+  }
+  if(a[9] != 'a' || b[0] != 'b' || b[2999] != 'b' ||
+     buf[0] != 'c' || buf[4] != 'c' || buf[5] != 'z'){
+    printf("%s: readv read the wrong bytes\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // pread and pwrite leave the file offset alone.
+  fd = open("iov", O_RDWR);
+  if(read(fd, buf, 4) != 4){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  if(pwrite(fd, "xy", 2, 3014) != 2 || pread(fd, buf, 3, 3013) != 3 ||
+     buf[0] != 'c' || buf[1] != 'x' || buf[2] != 'y'){
+    printf("%s: pwrite/pread failed\n", s);
+    exit(1);
+  }
+  if(pread(fd, buf, 10, 3016) != 0){
+    printf("%s: pread past the end returned data\n", s);
+    exit(1);
+  }
+  if(read(fd, buf, 7) != 7 || buf[5] != 'a' || buf[6] != 'b'){
+    printf("%s: pread/pwrite moved the file offset\n", s);
+    exit(1);
+  }
+  if(pread(fd, buf, 1, -1) != -1){
+    printf("%s: pread at a negative offset succeeded\n", s);
+    exit(1);
+  }
+
+  // children writing through the shared descriptor at their own
+  // offsets (within the file, which writes can't skip past)
+  // don't need to agree on the file offset.
+  for(i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      memset(b, '0' + i, 250);
+      for(int j = 0; j < 3; j++){
+        if(pwrite(fd, b, 250, (j * 4 + i) * 250) != 250)
+          exit(1);
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < 4; i++){
+    wait(&xst);
+    if(xst != 0){
+      printf("%s: child pwrite failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < 12; i++){
+    if(pread(fd, buf, 250, i * 250) != 250 ||
+       buf[0] != '0' + i % 4 || buf[249] != '0' + i % 4){
+      printf("%s: wrong data at block %d after pwrite\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("iov");
+
+  // pipes take vectors too, but not offsets.
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  iov[0].iov_base = "hello ";
+  iov[0].iov_len = 6;
+  iov[1].iov_base = "world";
+  iov[1].iov_len = 5;
+  if(writev(fds[1], iov, 2) != 11){
+    printf("%s: writev to pipe failed\n", s);
+    exit(1);
+  }
+  memset(buf, 0, sizeof(buf));
+  iov[0].iov_base = buf;
+  iov[0].iov_len = 3;
+  iov[1].iov_base = buf + 3;
+  iov[1].iov_len = 100;
+  if(readv(fds[0], iov, 2) != 11 || strcmp(buf, "hello world") != 0){
+    printf("%s: readv from pipe failed\n", s);
+    exit(1);
+  }
+  if(pread(fds[0], buf, 1, 0) != -1 || pwrite(fds[1], buf, 1, 0) != -1){
+    printf("%s: pread/pwrite on a pipe succeeded\n", s);
+    exit(1);
+  }
+  if(readv(fds[0], iov, MAXIOV+1) != -1){
+    printf("%s: readv of too many buffers succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// a directory that outgrows its first block becomes hashed;
+// every name must still be found, listed once, and removable.
+void
+hashdir(char *s)
+{
+  enum { N = 400 };
+  int i, fd, n;
+  char name[16];
+  struct dirent de;
+  struct stat st;
+
+  if(mkdir("hd") < 0){
+    printf("%s: mkdir hd failed\n", s);
+    exit(1);
+  }
+  fd = open("hd/f", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create hd/f failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  strcpy(name, "hd/x");
+  for(i = 0; i < N; i++){
+    name[4] = '0' + (i / 64);
+    name[5] = '0' + (i % 64);
+    name[6] = '\0';
+    if(link("hd/f", name) != 0){
+      printf("%s: link(hd/f, %s) failed\n", s, name);
+      exit(1);
+    }
+  }
+
+  for(i = 0; i < N; i++){
+    name[4] = '0' + (i / 64);
+    name[5] = '0' + (i % 64);
+    if(stat(name, &st) < 0 || st.nlink != N + 1){
+      printf("%s: stat %s failed\n", s, name);
+      exit(1);
+    }
+  }
+
+  // ".", "..", "f" and the links.
+  fd = open("hd", O_RDONLY);
+  n = 0;
+  while(read(fd, &de, sizeof(de)) == sizeof(de))
+    if(de.inum != 0)
+      n++;
+  close(fd);
+  if(n != N + 3){
+    printf("%s: hd lists %d entries, not %d\n", s, n, N + 3);
+    exit(1);
+  }
+
+  if(unlink("hd") == 0){
+    printf("%s: unlinked non-empty hd\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    name[4] = '0' + (i / 64);
+    name[5] = '0' + (i % 64);
+    if(unlink(name) != 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  if(unlink("hd/f") != 0 || unlink("hd") != 0){
+    printf("%s: unlink hd failed\n", s);
+    exit(1);
+  }
+}
+
 // concurrent writes to try to provoke deadlock in the virtio disk
 // driver.
 void
@@ -2812,6 +3931,45 @@ execout(char *s)
   exit(0);
 }
 
+// write to a new file name until the disk is full,
+// and return the number of blocks written.
+int
+fillblocks(char *s, char *name)
+{
+  static char buf[BSIZE];
+  int fd, n;
+
+  fd = open(name, O_CREATE|O_RDWR|O_TRUNC);
+  if(fd < 0){
+    printf("%s: create %s failed\n", s, name);
+    exit(1);
+  }
+  for(n = 0; write(fd, buf, BSIZE) == BSIZE; n++)
+    ;
+  close(fd);
+  return n;
+}
+
+// fill the disk twice with one file; the allocator must find
+// every block that unlink() freed.
+void
+freeblocks(char *s)
+{
+  int n1, n2;
+
+  n1 = fillblocks(s, "fb");
+  if(unlink("fb") != 0){
+    printf("%s: unlink fb failed\n", s);
+    exit(1);
+  }
+  n2 = fillblocks(s, "fb");
+  unlink("fb");
+  if(n1 < 100 || n1 != n2){
+    printf("%s: wrote %d then %d blocks\n", s, n1, n2);
+    exit(1);
+  }
+}
+
 // can the kernel tolerate running out of disk space?
 void
 diskfull(char *s)
@@ -2837,7 +3995,7 @@ diskfull(char *s)
       break;
     }
     for(int i = 0; i < MAXFILE; i++){
-      char buf[BSIZE];
+      static char buf[BSIZE];
       if(write(fd, buf, BSIZE) != BSIZE){
         done = 1;
         close(fd);
@@ -2926,10 +4084,16 @@ outofinodes(char *s)
 
 struct test slowtests[] = {
   {bigdir, "bigdir"},
+  {hashdir, "hashdir"},
+  {pagecache, "pagecache"},
+  {mmaptest, "mmaptest"},
+  {mmapcross, "mmapcross"},
+  {iovtest, "iovtest"},
   {manywrites, "manywrites"},
   {badwrite, "badwrite" },
   {execout, "execout"},
   {diskfull, "diskfull"},
+  {freeblocks, "freeblocks"},
   {outofinodes, "outofinodes"},
     
   { 0, 0},